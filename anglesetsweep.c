@@ -0,0 +1,274 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include "options.h"
+#include <stdlib.h>
+#include "sweep.h"
+#include "wire.h"
+
+void init_angle_set_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_angle_set_sweep(double **ybuf, double **zbuf, double *xbuf);
+
+/*
+ * Message buffers, the faces at wire precision and the requests for each
+ * set, kept between sweeps until the face sizes, --angle-sets or
+ * --precision change
+ */
+typedef struct angle_set_context {
+  options opt;
+  int ycount, zcount, xcount, nsets;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf;
+  void *ywire[2];
+  void *zwire[2];
+  MPI_Request *recvreq;
+  MPI_Request *sendreq[2];
+  MPI_Request *xsendreq;
+} angle_set_context;
+
+static angle_set_context *context = NULL;
+
+/*
+ * Perform a KBA sweep threading over groups inside the chunk, with the
+ * angles of each octant split into --angle-sets sets.
+ *
+ * Every chunk of every set is its own pipeline stage with its own faces,
+ * so the downwind neighbour starts on the first set of a chunk while this
+ * rank sweeps the next. The receives for all the sets of a chunk are
+ * posted together, and each set is swept as soon as its faces arrive.
+ */
+timings angle_set_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  const int nsets = opt.angle_sets;
+
+  /* Message buffers, wire faces and requests, built before the first sweep */
+  init_angle_set_context(mpi, opt);
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double *xbuf = context->xbuf;
+  void **ywire = context->ywire;
+  void **zwire = context->zwire;
+  MPI_Request *recvreq = context->recvreq;
+  MPI_Request **sendreq = context->sendreq;
+  MPI_Request *xsendreq = context->xsendreq;
+
+  time.setup = MPI_Wtime();
+  for (int s = 0; s < nsets; s++) {
+    recvreq[3*s+2] = MPI_REQUEST_NULL;
+    sendreq[0][2*s] = sendreq[0][2*s+1] = MPI_REQUEST_NULL;
+    sendreq[1][2*s] = sendreq[1][2*s+1] = MPI_REQUEST_NULL;
+    xsendreq[s] = MPI_REQUEST_NULL;
+  }
+  time.setup = MPI_Wtime() - time.setup;
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    const int xup = (i == 0) ? mpi.xhi : mpi.xlo;
+    const int yup = (j == 0) ? mpi.yhi : mpi.ylo;
+    const int zup = (k == 0) ? mpi.zhi : mpi.zlo;
+    const int xdown = (i == 0) ? mpi.xlo : mpi.xhi;
+    const int ydown = (j == 0) ? mpi.ylo : mpi.yhi;
+    const int zdown = (k == 0) ? mpi.zlo : mpi.zhi;
+
+    /* Loop over messages to send per octant */
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      const int buf = (o*opt.nchunks + c) % 2;
+
+      /*
+       * Post the receives for every set, into the buffer sent from two
+       * chunks ago once that has gone, and on the first chunk the x face.
+       * Messages are tagged with their set.
+       */
+      double comtime = MPI_Wtime();
+      MPI_Waitall(2*nsets, sendreq[buf], MPI_STATUSES_IGNORE);
+      if (c == 0) {
+        MPI_Waitall(nsets, xsendreq, MPI_STATUSES_IGNORE);
+      }
+      for (int s = 0; s < nsets; s++) {
+        int a0, na;
+        angle_set(opt, s, &a0, &na);
+        MPI_Irecv(wire_at(opt, ywire[buf], (long)a0*ycount), na*ycount, wire_type(opt), yup, s, mpi.comm, recvreq+3*s+0);
+        MPI_Irecv(wire_at(opt, zwire[buf], (long)a0*zcount), na*zcount, wire_type(opt), zup, s, mpi.comm, recvreq+3*s+1);
+        if (c == 0) {
+          MPI_Irecv(xbuf+a0*xcount, na*xcount, MPI_DOUBLE, xup, s, mpi.comm, recvreq+3*s+2);
+        }
+      }
+      time.comms += MPI_Wtime() - comtime;
+
+      /* Angle set loop - sweep each set as it arrives */
+      for (int s = 0; s < nsets; s++) {
+
+        int a0, na;
+        angle_set(opt, s, &a0, &na);
+        double *y = ybuf[buf]+a0*ycount;
+        double *z = zbuf[buf]+a0*zcount;
+        double *x = xbuf+a0*xcount;
+        void *yw = wire_at(opt, ywire[buf], (long)a0*ycount);
+        void *zw = wire_at(opt, zwire[buf], (long)a0*zcount);
+
+        comtime = MPI_Wtime();
+        MPI_Waitall(3, recvreq+3*s, MPI_STATUSES_IGNORE);
+        double packtime = MPI_Wtime();
+        unpack_wire(opt, yw, y, na*ycount);
+        unpack_wire(opt, zw, z, na*zcount);
+        time.packing += MPI_Wtime() - packtime;
+        time.comms += MPI_Wtime() - comtime;
+
+        #pragma omp parallel for
+        for (int g = 0; g < opt.ng; g++) {
+
+          /* Do proportional "work" */
+          compute_angle_set(opt, oct, c, s, g, g, opt.ng, y, z, x);
+
+        } /* End group loop */
+
+        /* Send payload to downwind neighbours */
+        comtime = MPI_Wtime();
+        packtime = MPI_Wtime();
+        pack_wire(opt, y, yw, na*ycount);
+        pack_wire(opt, z, zw, na*zcount);
+        time.packing += MPI_Wtime() - packtime;
+        MPI_Isend(yw, na*ycount, wire_type(opt), ydown, s, mpi.comm, sendreq[buf]+2*s+0);
+        MPI_Isend(zw, na*zcount, wire_type(opt), zdown, s, mpi.comm, sendreq[buf]+2*s+1);
+        if (ydown != MPI_PROC_NULL) time.bytes += (double)na*ycount*wire_bytes(opt);
+        if (zdown != MPI_PROC_NULL) time.bytes += (double)na*zcount*wire_bytes(opt);
+
+        /* The x face leaves after the last chunk */
+        if (c == opt.nchunks-1) {
+          MPI_Isend(x, na*xcount, MPI_DOUBLE, xdown, s, mpi.comm, xsendreq+s);
+        }
+        time.comms += MPI_Wtime() - comtime;
+
+      } /* End angle set loop */
+    } /* End nchunks loop */
+  } /* End octant loop */
+
+  /* Make sure the last faces have gone before the buffers are used again */
+  double comtime = MPI_Wtime();
+  for (int b = 0; b < 2; b++) {
+    MPI_Waitall(2*nsets, sendreq[b], MPI_STATUSES_IGNORE);
+  }
+  MPI_Waitall(nsets, xsendreq, MPI_STATUSES_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/* Allocate MPI message buffers */
+void init_angle_set_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  *xbuf = malloc(sizeof(double)*xcount);
+}
+
+/* Free MPI message buffers */
+void end_angle_set_sweep(double **ybuf, double **zbuf, double *xbuf) {
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  free(xbuf);
+}
+
+
+/*
+ * Build the message buffers - two of each so that a receive never lands
+ * in a buffer which is still being sent from, and one for the x face,
+ * with each set's faces for all groups contiguous, starting at its first
+ * angle, so no set's message overlaps another's - the y and z faces at
+ * the precision selected with --precision, and the requests for the y,
+ * z and x faces of each set and the sends from each buffer, unless those
+ * from an earlier sweep are still right.
+ */
+void init_angle_set_context(mpistate mpi, options opt) {
+  (void)mpi;
+  const int ycount = opt.nz * opt.chunklen * opt.ng;
+  const int zcount = opt.ny * opt.chunklen * opt.ng;
+  const int xcount = opt.ny * opt.nz * opt.ng;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->opt.nang == opt.nang
+      && context->nsets == opt.angle_sets && context->opt.precision == opt.precision) return;
+    end_angle_set_context();
+  }
+
+  context = malloc(sizeof(angle_set_context));
+  context->opt = opt;
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->nsets = opt.angle_sets;
+  init_angle_set_sweep(opt.nang*ycount, opt.nang*zcount, opt.nang*xcount, context->ybuf, context->zbuf, &context->xbuf);
+  for (int b = 0; b < 2; b++) {
+    context->ywire[b] = init_wire(opt, context->ybuf[b], (long)opt.nang*ycount);
+    context->zwire[b] = init_wire(opt, context->zbuf[b], (long)opt.nang*zcount);
+  }
+
+  context->recvreq = malloc(sizeof(MPI_Request)*3*opt.angle_sets);
+  for (int b = 0; b < 2; b++) {
+    context->sendreq[b] = malloc(sizeof(MPI_Request)*2*opt.angle_sets);
+  }
+  context->xsendreq = malloc(sizeof(MPI_Request)*opt.angle_sets);
+}
+
+/* Free the message buffers, wire faces and requests */
+void end_angle_set_context(void) {
+  if (!context) return;
+
+  for (int b = 0; b < 2; b++) {
+    end_wire(context->opt, context->ywire[b]);
+    end_wire(context->opt, context->zwire[b]);
+    free(context->sendreq[b]);
+  }
+  end_angle_set_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context->recvreq);
+  free(context->xsendreq);
+  free(context);
+  context = NULL;
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "autotune.h"
+#include "comms.h"
+#include "compute.h"
+#include <math.h>
+#include <mpi.h>
+#include "options.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "sweep.h"
+
+double trial_sweep(mpistate mpi, options opt, sweeper sweep, int nchunks, int nx);
+int fit_model(int npts, const int *n, const double *t, double *coef);
+double model_time(const double *coef, int n);
+
+void autotune(mpistate mpi, options *opt, sweeper sweep) {
+
+  const int nx = opt->nchunks * opt->chunklen;
+
+  /* Every rank must search the same candidates, as each trial is collective */
+  int nxmin, nxmax;
+  MPI_Allreduce(&nx, &nxmin, 1, MPI_INT, MPI_MIN, mpi.comm);
+  MPI_Allreduce(&nx, &nxmax, 1, MPI_INT, MPI_MAX, mpi.comm);
+  if (nxmin != nxmax) {
+    if (mpi.rank == 0) {
+      printf("Autotuning needs the same x extent on every rank\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_Barrier(mpi.comm);
+  }
+
+  /* Candidate numbers of chunks are the divisors of the x extent, in increasing order */
+  int *cand = malloc(sizeof(int)*nx);
+  int ncand = 0;
+  for (int n = 1; n <= nx; n++) {
+    if (nx % n == 0) {
+      cand[ncand++] = n;
+    }
+  }
+
+  /* Measured time for each candidate, negative until tried */
+  double *measured = malloc(sizeof(double)*ncand);
+  for (int c = 0; c < ncand; c++) {
+    measured[c] = -1.0;
+  }
+
+  if (mpi.rank == 0) {
+    printf("Autotuning %d cells in x over %d configurations\n", nx, ncand);
+  }
+
+  /*
+   * Golden-section search over the candidates, assuming the sweep time
+   * falls and then rises with the number of chunks as pipeline fill
+   * gives way to message overheads.
+   */
+  const double invphi = (sqrt(5.0) - 1.0) / 2.0;
+  int lo = 0;
+  int hi = ncand-1;
+  while (hi - lo > 2) {
+    const int r = (int)lround((hi-lo)*invphi);
+    const int a = hi - r;
+    const int b = (lo + r > a) ? lo + r : a + 1;
+    if (measured[a] < 0.0) measured[a] = trial_sweep(mpi, *opt, sweep, cand[a], nx);
+    if (measured[b] < 0.0) measured[b] = trial_sweep(mpi, *opt, sweep, cand[b], nx);
+    if (measured[a] <= measured[b]) {
+      hi = b;
+    }
+    else {
+      lo = a;
+    }
+  }
+  for (int c = lo; c <= hi; c++) {
+    if (measured[c] < 0.0) measured[c] = trial_sweep(mpi, *opt, sweep, cand[c], nx);
+  }
+
+  /*
+   * Fit T = A + B*nchunks + C/nchunks to the trials: B is the cost of each
+   * extra message and C the pipeline fill, which shrinks with the chunk.
+   * Where the model expects an untried candidate to win, try it too.
+   */
+  int *tn = malloc(sizeof(int)*ncand);
+  double *tt = malloc(sizeof(double)*ncand);
+  int npts = 0;
+  for (int c = 0; c < ncand; c++) {
+    if (measured[c] >= 0.0) {
+      tn[npts] = cand[c];
+      tt[npts] = measured[c];
+      npts++;
+    }
+  }
+  double coef[3];
+  const int fitted = fit_model(npts, tn, tt, coef);
+  if (fitted) {
+    int guess = 0;
+    for (int c = 1; c < ncand; c++) {
+      if (model_time(coef, cand[c]) < model_time(coef, cand[guess])) {
+        guess = c;
+      }
+    }
+    if (measured[guess] < 0.0) measured[guess] = trial_sweep(mpi, *opt, sweep, cand[guess], nx);
+  }
+
+  /* Keep the fastest measured configuration */
+  int best = -1;
+  for (int c = 0; c < ncand; c++) {
+    if (measured[c] >= 0.0 && (best < 0 || measured[c] < measured[best])) {
+      best = c;
+    }
+  }
+
+  opt->nchunks = cand[best];
+  opt->chunklen = nx / cand[best];
+
+  if (mpi.rank == 0) {
+    printf("Autotuned: %d chunks of %d cells\n", opt->nchunks, opt->chunklen);
+    if (fitted) {
+      printf("  Model: %.3e + %.3e*nchunks + %.3e/nchunks s\n", coef[0], coef[1], coef[2]);
+      printf("  Predicted sweep time: %11.6lf s\n", model_time(coef, opt->nchunks));
+    }
+    printf("  Measured sweep time:  %11.6lf s\n", measured[best]);
+    printf("\n");
+  }
+
+  free(cand);
+  free(measured);
+  free(tn);
+  free(tt);
+}
+
+/* Fastest of the trial sweeps with this many chunks, taking the slowest rank */
+double trial_sweep(mpistate mpi, options opt, sweeper sweep, int nchunks, int nx) {
+  opt.nchunks = nchunks;
+  opt.chunklen = nx / nchunks;
+
+  double best = 0.0;
+  for (int s = 0; s < TUNE_SWEEPS; s++) {
+    reset_compute(opt);
+    timings time = sweep(mpi, opt);
+    double slowest;
+    MPI_Allreduce(&time.sweeping, &slowest, 1, MPI_DOUBLE, MPI_MAX, mpi.comm);
+    if (s == 0 || slowest < best) {
+      best = slowest;
+    }
+  }
+
+  if (mpi.rank == 0) {
+    printf("  %6d chunks of %6d cells: %11.6lf s\n", opt.nchunks, opt.chunklen, best);
+  }
+  return best;
+}
+
+/*
+ * Least squares fit of t = coef[0] + coef[1]*n + coef[2]/n.
+ * Returns zero if there are too few points to determine the model.
+ */
+int fit_model(int npts, const int *n, const double *t, double *coef) {
+  if (npts < 3) return 0;
+
+  /* Normal equations, with the right hand side as the last column */
+  double m[3][4] = {{0.0}};
+  for (int p = 0; p < npts; p++) {
+    const double basis[3] = {1.0, (double)n[p], 1.0/n[p]};
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+        m[r][c] += basis[r]*basis[c];
+      }
+      m[r][3] += basis[r]*t[p];
+    }
+  }
+
+  /* Gaussian elimination with partial pivoting */
+  for (int c = 0; c < 3; c++) {
+    int piv = c;
+    for (int r = c+1; r < 3; r++) {
+      if (fabs(m[r][c]) > fabs(m[piv][c])) piv = r;
+    }
+    if (fabs(m[piv][c]) < 1.0e-300) return 0;
+    for (int e = 0; e < 4; e++) {
+      const double tmp = m[c][e];
+      m[c][e] = m[piv][e];
+      m[piv][e] = tmp;
+    }
+    for (int r = c+1; r < 3; r++) {
+      const double f = m[r][c] / m[c][c];
+      for (int e = c; e < 4; e++) {
+        m[r][e] -= f*m[c][e];
+      }
+    }
+  }
+  for (int r = 2; r >= 0; r--) {
+    double sum = m[r][3];
+    for (int c = r+1; c < 3; c++) {
+      sum -= m[r][c]*coef[c];
+    }
+    coef[r] = sum / m[r][r];
+  }
+  return 1;
+}
+
+/* Sweep time predicted by the fitted model */
+double model_time(const double *coef, int n) {
+  return coef[0] + coef[1]*n + coef[2]/n;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * KBA block size auto-tuner
+ * Searches the ways of splitting the subdomain's x extent into chunks
+ * with short trial sweeps, and picks the fastest.
+ */
+
+#pragma once
+
+#include "comms.h"
+#include "options.h"
+#include "sweep.h"
+
+/* Number of trial sweeps for each configuration - the fastest is kept */
+#ifndef TUNE_SWEEPS
+#define TUNE_SWEEPS 2
+#endif
+
+/*
+ * Find the nchunks and chunklen with the same product which give the
+ * fastest sweep, and set them in opt.
+ * The compute state must already be set up.
+ */
+void autotune(mpistate mpi, options *opt, sweeper sweep);
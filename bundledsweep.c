@@ -0,0 +1,278 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include "options.h"
+#include <stdlib.h>
+#include "sweep.h"
+#include "wire.h"
+
+void init_bundled_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_bundled_sweep(double **ybuf, double **zbuf, double *xbuf);
+
+/*
+ * Message buffers, the faces at wire precision and the requests for each
+ * bundle, kept between sweeps until the face sizes, the bundles or
+ * --precision change
+ */
+typedef struct bundled_context {
+  options opt;
+  int ycount, zcount, xcount, nbundles;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf;
+  void *ywire[2];
+  void *zwire[2];
+  MPI_Request *recvreq;
+  MPI_Request *sendreq[2];
+  MPI_Request *xsendreq;
+} bundled_context;
+
+static bundled_context *context = NULL;
+
+/*
+ * Perform a KBA sweep threading over groups inside a bundle of
+ * --groups-per-msg groups, sending each bundle's faces in one message.
+ *
+ * The receives for all the bundles of a chunk are posted together, and
+ * each bundle is swept and sent as soon as its own faces arrive, so the
+ * downwind neighbour starts on the first bundle while this rank sweeps
+ * the next. One group per message is the serial sweeper's granularity,
+ * and all of them the parallel group sweeper's.
+ */
+timings bundled_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  /* Groups in each bundle - the last may have fewer */
+  const int gpm = (opt.groups_per_msg < opt.ng) ? opt.groups_per_msg : opt.ng;
+  const int nbundles = (opt.ng + gpm - 1) / gpm;
+
+  /* Message buffers, wire faces and requests, built before the first sweep */
+  init_bundled_context(mpi, opt);
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double *xbuf = context->xbuf;
+  void **ywire = context->ywire;
+  void **zwire = context->zwire;
+  MPI_Request *recvreq = context->recvreq;
+  MPI_Request **sendreq = context->sendreq;
+  MPI_Request *xsendreq = context->xsendreq;
+
+  time.setup = MPI_Wtime();
+  for (int n = 0; n < nbundles; n++) {
+    recvreq[3*n+2] = MPI_REQUEST_NULL;
+    sendreq[0][2*n] = sendreq[0][2*n+1] = MPI_REQUEST_NULL;
+    sendreq[1][2*n] = sendreq[1][2*n+1] = MPI_REQUEST_NULL;
+    xsendreq[n] = MPI_REQUEST_NULL;
+  }
+  time.setup = MPI_Wtime() - time.setup;
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    const int xup = (i == 0) ? mpi.xhi : mpi.xlo;
+    const int yup = (j == 0) ? mpi.yhi : mpi.ylo;
+    const int zup = (k == 0) ? mpi.zhi : mpi.zlo;
+    const int xdown = (i == 0) ? mpi.xlo : mpi.xhi;
+    const int ydown = (j == 0) ? mpi.ylo : mpi.yhi;
+    const int zdown = (k == 0) ? mpi.zlo : mpi.zhi;
+
+    /* Loop over messages to send per octant */
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      const int buf = (o*opt.nchunks + c) % 2;
+
+      /*
+       * Post the receives for every bundle, into the buffer sent from two
+       * chunks ago once that has gone, and on the first chunk the x face.
+       * Messages are tagged with their bundle.
+       */
+      double comtime = MPI_Wtime();
+      MPI_Waitall(2*nbundles, sendreq[buf], MPI_STATUSES_IGNORE);
+      if (c == 0) {
+        MPI_Waitall(nbundles, xsendreq, MPI_STATUSES_IGNORE);
+      }
+      for (int n = 0; n < nbundles; n++) {
+        const int g0 = n*gpm;
+        const int ngb = (g0 + gpm < opt.ng) ? gpm : opt.ng - g0;
+        MPI_Irecv(wire_at(opt, ywire[buf], (long)g0*ycount), ngb*ycount, wire_type(opt), yup, n, mpi.comm, recvreq+3*n+0);
+        MPI_Irecv(wire_at(opt, zwire[buf], (long)g0*zcount), ngb*zcount, wire_type(opt), zup, n, mpi.comm, recvreq+3*n+1);
+        if (c == 0) {
+          MPI_Irecv(xbuf+g0*xcount, ngb*xcount, MPI_DOUBLE, xup, n, mpi.comm, recvreq+3*n+2);
+        }
+      }
+      time.comms += MPI_Wtime() - comtime;
+
+      /* Bundle loop - sweep each bundle as it arrives */
+      for (int n = 0; n < nbundles; n++) {
+
+        const int g0 = n*gpm;
+        const int ngb = (g0 + gpm < opt.ng) ? gpm : opt.ng - g0;
+        double *y = ybuf[buf]+g0*ycount;
+        double *z = zbuf[buf]+g0*zcount;
+        double *x = xbuf+g0*xcount;
+        void *yw = wire_at(opt, ywire[buf], (long)g0*ycount);
+        void *zw = wire_at(opt, zwire[buf], (long)g0*zcount);
+
+        comtime = MPI_Wtime();
+        MPI_Waitall(3, recvreq+3*n, MPI_STATUSES_IGNORE);
+        double packtime = MPI_Wtime();
+        unpack_wire(opt, yw, y, ngb*ycount);
+        unpack_wire(opt, zw, z, ngb*zcount);
+        time.packing += MPI_Wtime() - packtime;
+        time.comms += MPI_Wtime() - comtime;
+
+        #pragma omp parallel for
+        for (int g = g0; g < g0+ngb; g++) {
+
+          /* Do proportional "work" */
+          compute_chunk(opt, oct, c, g, g-g0, ngb, y, z, x);
+
+        } /* End group loop */
+
+        /* Send payload to downwind neighbours */
+        comtime = MPI_Wtime();
+        packtime = MPI_Wtime();
+        pack_wire(opt, y, yw, ngb*ycount);
+        pack_wire(opt, z, zw, ngb*zcount);
+        time.packing += MPI_Wtime() - packtime;
+        MPI_Isend(yw, ngb*ycount, wire_type(opt), ydown, n, mpi.comm, sendreq[buf]+2*n+0);
+        MPI_Isend(zw, ngb*zcount, wire_type(opt), zdown, n, mpi.comm, sendreq[buf]+2*n+1);
+        if (ydown != MPI_PROC_NULL) time.bytes += (double)ngb*ycount*wire_bytes(opt);
+        if (zdown != MPI_PROC_NULL) time.bytes += (double)ngb*zcount*wire_bytes(opt);
+
+        /* The x face leaves after the last chunk */
+        if (c == opt.nchunks-1) {
+          MPI_Isend(x, ngb*xcount, MPI_DOUBLE, xdown, n, mpi.comm, xsendreq+n);
+        }
+        time.comms += MPI_Wtime() - comtime;
+
+      } /* End bundle loop */
+    } /* End nchunks loop */
+  } /* End octant loop */
+
+  /* Make sure the last faces have gone before the buffers are used again */
+  double comtime = MPI_Wtime();
+  for (int b = 0; b < 2; b++) {
+    MPI_Waitall(2*nbundles, sendreq[b], MPI_STATUSES_IGNORE);
+  }
+  MPI_Waitall(nbundles, xsendreq, MPI_STATUSES_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/* Allocate MPI message buffers */
+void init_bundled_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  *xbuf = malloc(sizeof(double)*xcount);
+}
+
+/* Free MPI message buffers */
+void end_bundled_sweep(double **ybuf, double **zbuf, double *xbuf) {
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  free(xbuf);
+}
+
+
+/*
+ * Build the message buffers - two of each so that a receive never lands
+ * in a buffer which is still being sent from, and one for the x face,
+ * with each bundle's faces contiguous, starting at its first group - the
+ * y and z faces at the precision selected with --precision, and the
+ * requests for the y, z and x faces of each bundle and the sends from
+ * each buffer, unless those from an earlier sweep are still right.
+ */
+void init_bundled_context(mpistate mpi, options opt) {
+  (void)mpi;
+  const int gpm = (opt.groups_per_msg < opt.ng) ? opt.groups_per_msg : opt.ng;
+  const int nbundles = (opt.ng + gpm - 1) / gpm;
+  const int ycount = opt.nang * opt.nz * opt.chunklen;
+  const int zcount = opt.nang * opt.ny * opt.chunklen;
+  const int xcount = opt.nang * opt.ny * opt.nz;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->opt.ng == opt.ng
+      && context->nbundles == nbundles && context->opt.precision == opt.precision) return;
+    end_bundled_context();
+  }
+
+  context = malloc(sizeof(bundled_context));
+  context->opt = opt;
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->nbundles = nbundles;
+  init_bundled_sweep(opt.ng*ycount, opt.ng*zcount, opt.ng*xcount, context->ybuf, context->zbuf, &context->xbuf);
+  for (int b = 0; b < 2; b++) {
+    context->ywire[b] = init_wire(opt, context->ybuf[b], (long)opt.ng*ycount);
+    context->zwire[b] = init_wire(opt, context->zbuf[b], (long)opt.ng*zcount);
+  }
+
+  context->recvreq = malloc(sizeof(MPI_Request)*3*nbundles);
+  for (int b = 0; b < 2; b++) {
+    context->sendreq[b] = malloc(sizeof(MPI_Request)*2*nbundles);
+  }
+  context->xsendreq = malloc(sizeof(MPI_Request)*nbundles);
+}
+
+/* Free the message buffers, wire faces and requests */
+void end_bundled_context(void) {
+  if (!context) return;
+
+  for (int b = 0; b < 2; b++) {
+    end_wire(context->opt, context->ywire[b]);
+    end_wire(context->opt, context->zwire[b]);
+    free(context->sendreq[b]);
+  }
+  end_bundled_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context->recvreq);
+  free(context->xsendreq);
+  free(context);
+  context = NULL;
+}
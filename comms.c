@@ -22,23 +22,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+void place_ranks(mpistate *mpi);
+int node_tile(mpistate *mpi, int nodesize);
+void count_links(mpistate *mpi, int node);
+
 /* Divide MPI ranks, independent of mesh size - useful for weak scaling */
 void decompose(mpistate *mpi) {
 
   /* Try options for decomposition - minimise perimeter to area ratio */
   double best = DBL_MAX;
 
-  for (int npey = 1; npey <= mpi->nprocs; npey++) {
+  /* Ranks in each YZ plane */
+  const int nyz = mpi->nprocs / mpi->npex;
+
+  for (int npey = 1; npey <= nyz; npey++) {
 
     /* Skip non-divisible options */
-    if (mpi->nprocs % npey) continue;
+    if (nyz % npey) continue;
 
     /* Number of ranks for z-dimension */
-    int npez = mpi->nprocs / npey;
-    if (mpi->nprocs % npez) continue;
+    int npez = nyz / npey;
+    if (nyz % npez) continue;
 
-    double perimeter = ((mpi->nprocs/npey) + (mpi->nprocs/npez)) * 2.0;
-    double area = (mpi->nprocs/npey) * (mpi->nprocs/npez);
+    double perimeter = ((nyz/npey) + (nyz/npez)) * 2.0;
+    double area = (nyz/npey) * (nyz/npez);
     double ratio = perimeter / area;
 
     /* Save best so far */
@@ -49,15 +56,7 @@ void decompose(mpistate *mpi) {
     }
   }
 
-  /* Set ranks along dimension */
-  mpi->y = mpi->rank % mpi->npey;
-  mpi->z = mpi->rank / mpi->npey;
-
-  /* Set neighbour ranks */
-  mpi->ylo = (mpi->y == 0) ? MPI_PROC_NULL : (mpi->y-1) + mpi->z*mpi->npey;
-  mpi->yhi = (mpi->y == mpi->npey-1) ? MPI_PROC_NULL : (mpi->y+1) + mpi->z*mpi->npey;
-  mpi->zlo = (mpi->z == 0) ? MPI_PROC_NULL : mpi->y + (mpi->z-1)*mpi->npey;
-  mpi->zhi = (mpi->z == mpi->npez-1) ? MPI_PROC_NULL : mpi->y + (mpi->z+1)*mpi->npey;
+  place_ranks(mpi);
 }
 
 /* Decompose the mesh itself, sharing out any extra cells - useful for strong scaling */
@@ -66,14 +65,17 @@ void decompose_mesh(mpistate *mpi, options *opt) {
   /* Try options for decomposition - minimise perimeter to area ratio */
   double best = DBL_MAX;
 
-  for (int npey = 1; npey <= mpi->nprocs; npey++) {
+  /* Ranks in each YZ plane */
+  const int nyz = mpi->nprocs / mpi->npex;
+
+  for (int npey = 1; npey <= nyz; npey++) {
 
     /* Skip non-divisible options */
-    if (mpi->nprocs % npey) continue;
+    if (nyz % npey) continue;
 
     /* Number of ranks for z-dimension */
-    int npez = mpi->nprocs / npey;
-    if (mpi->nprocs % npez) continue;
+    int npez = nyz / npey;
+    if (nyz % npez) continue;
 
     double perimeter = ((opt->gny/npey) + (opt->gnz/npez)) * 2.0;
     double area = (opt->gny/npey) * (opt->gnz/npez);
@@ -87,9 +89,7 @@ void decompose_mesh(mpistate *mpi, options *opt) {
     }
   }
 
-  /* Set ranks along dimension */
-  mpi->y = mpi->rank % mpi->npey;
-  mpi->z = mpi->rank / mpi->npey;
+  place_ranks(mpi);
 
   /* Set cells per dimension, rouding down */
   opt->ny = opt->gny / mpi->npey;
@@ -99,6 +99,10 @@ void decompose_mesh(mpistate *mpi, options *opt) {
   int extra_y = opt->gny % mpi->npey;
   int extra_z = opt->gnz % mpi->npez;
 
+  /* Share the chunks along x, rounding down */
+  int extra_x = opt->nchunks % mpi->npex;
+  opt->nchunks /= mpi->npex;
+
   /* Distribute cells evenly to ranks */
   if (extra_y && mpi->y < extra_y) {
     opt->ny += 1;
@@ -106,11 +110,172 @@ void decompose_mesh(mpistate *mpi, options *opt) {
   if (extra_z && mpi->z < extra_z) {
     opt->nz += 1;
   }
+  if (extra_x && mpi->x < extra_x) {
+    opt->nchunks += 1;
+  }
+}
+
+
+/*
+ * Create the Cartesian communicator, letting MPI reorder the ranks, and set
+ * each rank's position and neighbours from it. With node-aware placement the
+ * ranks are first ordered so each node's ranks fill a compact tile.
+ */
+void place_ranks(mpistate *mpi) {
+
+  /* Ranks which share memory are on the same node */
+  MPI_Comm nodecomm;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &nodecomm);
+  int noderank, nodesize;
+  MPI_Comm_rank(nodecomm, &noderank);
+  MPI_Comm_size(nodecomm, &nodesize);
+
+  /* Number the nodes in the order of their first ranks */
+  MPI_Comm leaders;
+  MPI_Comm_split(MPI_COMM_WORLD, (noderank == 0) ? 0 : MPI_UNDEFINED, mpi->rank, &leaders);
+  int node = 0;
+  if (noderank == 0) {
+    MPI_Comm_rank(leaders, &node);
+    MPI_Comm_size(leaders, &mpi->nnodes);
+    MPI_Comm_free(&leaders);
+  }
+  MPI_Bcast(&node, 1, MPI_INT, 0, nodecomm);
+  MPI_Bcast(&mpi->nnodes, 1, MPI_INT, 0, nodecomm);
+  MPI_Comm_free(&nodecomm);
+
+  /* Position of this rank, with x varying fastest */
+  int key = mpi->rank;
+  if (mpi->placement == NODE_PLACEMENT && node_tile(mpi, nodesize)) {
+    const int ntx = mpi->npex / mpi->tile[0];
+    const int nty = mpi->npey / mpi->tile[1];
+    const int x = (node % ntx) * mpi->tile[0] + noderank % mpi->tile[0];
+    const int y = ((node / ntx) % nty) * mpi->tile[1] + (noderank / mpi->tile[0]) % mpi->tile[1];
+    const int z = ((node / ntx) / nty) * mpi->tile[2] + (noderank / mpi->tile[0]) / mpi->tile[1];
+    key = x + mpi->npex*(y + mpi->npey*z);
+  }
+  else {
+    mpi->tile[0] = mpi->tile[1] = mpi->tile[2] = 0;
+  }
+  MPI_Comm ordered;
+  MPI_Comm_split(MPI_COMM_WORLD, 0, key, &ordered);
+
+  /* Dimensions are in row major order, so x is last to vary fastest */
+  int dims[3] = {mpi->npez, mpi->npey, mpi->npex};
+  int periods[3] = {0, 0, 0};
+  MPI_Cart_create(ordered, 3, dims, periods, 1, &mpi->comm);
+  MPI_Comm_free(&ordered);
+
+  int coords[3];
+  MPI_Comm_rank(mpi->comm, &mpi->rank);
+  MPI_Cart_coords(mpi->comm, mpi->rank, 3, coords);
+  mpi->z = coords[0];
+  mpi->y = coords[1];
+  mpi->x = coords[2];
+  MPI_Cart_shift(mpi->comm, 2, 1, &mpi->xlo, &mpi->xhi);
+  MPI_Cart_shift(mpi->comm, 1, 1, &mpi->ylo, &mpi->yhi);
+  MPI_Cart_shift(mpi->comm, 0, 1, &mpi->zlo, &mpi->zhi);
+
+  count_links(mpi, node);
+}
+
+/*
+ * Pick the tile of ranks for each node which cuts the fewest neighbour
+ * links, if every node has the same number of ranks and it divides the
+ * decomposition evenly. Returns zero if there is no such tile.
+ */
+int node_tile(mpistate *mpi, int nodesize) {
+
+  int sizes[2] = {nodesize, -nodesize};
+  MPI_Allreduce(MPI_IN_PLACE, sizes, 2, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+  if (sizes[0] != -sizes[1]) return 0;
+
+  int best = -1;
+  for (int tz = 1; tz <= mpi->npez; tz++) {
+    if (mpi->npez % tz || nodesize % tz) continue;
+    for (int ty = 1; ty <= mpi->npey; ty++) {
+      if (mpi->npey % ty || (nodesize/tz) % ty) continue;
+      const int tx = nodesize / (tz*ty);
+      if (mpi->npex % tx) continue;
+
+      /* Links leaving each tile through its faces */
+      int cut = 0;
+      if (tx < mpi->npex) cut += 2*ty*tz;
+      if (ty < mpi->npey) cut += 2*tx*tz;
+      if (tz < mpi->npez) cut += 2*tx*ty;
+
+      if (best < 0 || cut < best) {
+        best = cut;
+        mpi->tile[0] = tx;
+        mpi->tile[1] = ty;
+        mpi->tile[2] = tz;
+      }
+    }
+  }
+  return (best >= 0);
+}
+
+/* Count the neighbour links in each dimension, and those which cross between nodes */
+void count_links(mpistate *mpi, int node) {
+
+  int *nodes = malloc(sizeof(int)*mpi->nprocs);
+  MPI_Allgather(&node, 1, MPI_INT, nodes, 1, MPI_INT, mpi->comm);
+
+  /* Each link is counted by the rank at its lo end */
+  const int hi[3] = {mpi->xhi, mpi->yhi, mpi->zhi};
+  int counts[6] = {0};
+  for (int d = 0; d < 3; d++) {
+    if (hi[d] == MPI_PROC_NULL) continue;
+    counts[d] = 1;
+    counts[3+d] = (nodes[hi[d]] != node);
+  }
+  MPI_Allreduce(MPI_IN_PLACE, counts, 6, MPI_INT, MPI_SUM, mpi->comm);
+  for (int d = 0; d < 3; d++) {
+    mpi->links[d] = counts[d];
+    mpi->offnode[d] = counts[3+d];
+  }
+
+  free(nodes);
+}
+
+/*
+ * Each group gets its own duplicate of comm, so the library can match
+ * each group's messages on its own. With hints the sweepers promise
+ * never to receive from MPI_ANY_SOURCE or with MPI_ANY_TAG on them.
+ */
+void init_group_comms(mpistate *mpi, options opt) {
+  mpi->groupcomm = NULL;
+  if (opt.match == TAG_MATCH) return;
+
+  MPI_Info info = MPI_INFO_NULL;
+  if (opt.match == HINTED_MATCH) {
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "mpi_assert_no_any_tag", "true");
+    MPI_Info_set(info, "mpi_assert_no_any_source", "true");
+  }
 
-  /* Set neighbour ranks */
-  mpi->ylo = (mpi->y == 0) ? MPI_PROC_NULL : (mpi->y-1) + mpi->z*mpi->npey;
-  mpi->yhi = (mpi->y == mpi->npey-1) ? MPI_PROC_NULL : (mpi->y+1) + mpi->z*mpi->npey;
-  mpi->zlo = (mpi->z == 0) ? MPI_PROC_NULL : mpi->y + (mpi->z-1)*mpi->npey;
-  mpi->zhi = (mpi->z == mpi->npez-1) ? MPI_PROC_NULL : mpi->y + (mpi->z+1)*mpi->npey;
+  mpi->groupcomm = malloc(sizeof(MPI_Comm)*opt.ng);
+  for (int g = 0; g < opt.ng; g++) {
+    MPI_Comm_dup_with_info(mpi->comm, info, &mpi->groupcomm[g]);
+  }
+
+  if (info != MPI_INFO_NULL) MPI_Info_free(&info);
 }
 
+void end_group_comms(mpistate *mpi, options opt) {
+  if (!mpi->groupcomm) return;
+
+  for (int g = 0; g < opt.ng; g++) {
+    MPI_Comm_free(&mpi->groupcomm[g]);
+  }
+  free(mpi->groupcomm);
+  mpi->groupcomm = NULL;
+}
+
+MPI_Comm group_comm(mpistate mpi, int g) {
+  return mpi.groupcomm ? mpi.groupcomm[g] : mpi.comm;
+}
+
+/* On its own communicator a group only needs the octant, as threads may run ahead into the next one */
+int group_tag(options opt, int oct, int g) {
+  return (opt.match == TAG_MATCH) ? oct*opt.ng + g : oct;
+}
@@ -22,35 +22,83 @@
 
 #pragma once
 
+#include <mpi.h>
 #include "options.h"
 
+/* How ranks are placed in the decomposition */
+enum placement {NODE_PLACEMENT, LINEAR_PLACEMENT};
+
+/*
+ * How the messages of concurrent group sweeps are told apart - by tag on
+ * comm, or by a communicator for each group, optionally with hints that
+ * no receive uses a wildcard
+ */
+enum match {TAG_MATCH, COMM_MATCH, HINTED_MATCH};
+
 typedef struct mpistate {
 
   /* Level of thread support provided by MPI implementation */
   int thread_support;
 
-  /* Process rank */
+  /* Process rank in comm */
   int rank;
 
+  /* Cartesian communicator for the decomposition, used for all communication */
+  MPI_Comm comm;
+
   /* Number of ranks in MPI_COMM_WORLD */
   int nprocs;
 
-  /* Number of ranks in 2D decomposition */
+  /* Number of ranks in each dimension - npex is 1 for a 2D decomposition */
+  int npex;
   int npey;
   int npez;
 
-  /* Process rank in 2D decomposition */
+  /* Process rank in decomposition */
+  int x;
   int y;
   int z;
 
-  /* Neighbour ranks - 2D decomposition of 3D domain */
+  /* Neighbour ranks - 2D or 3D decomposition of 3D domain */
+  int xhi;
+  int xlo;
   int yhi;
   int ylo;
   int zhi;
   int zlo;
 
+  /* Rank placement - NODE_PLACEMENT fills a compact tile with each node's ranks */
+  int placement;
+
+  /* Number of nodes, and the tile of ranks each fills in x, y and z - all 0 if not tiled */
+  int nnodes;
+  int tile[3];
+
+  /* Neighbour links in x, y and z, and how many of them cross between nodes */
+  int links[3];
+  int offnode[3];
+
+  /* Duplicate of comm for each group with --match comm or hints - NULL if not in use */
+  MPI_Comm *groupcomm;
+
 } mpistate;
 
+/*
+ * The ranks are split into npex groups along X, which must be set
+ * beforehand along with placement, and each group is decomposed in YZ.
+ * Both create mpi->comm, which the caller frees.
+ */
 void decompose(mpistate *mpi);
 void decompose_mesh(mpistate *mpi, options *opt);
 
+/*
+ * Create, or free, the communicators for each group as selected with
+ * --match. Collective over all ranks.
+ */
+void init_group_comms(mpistate *mpi, options opt);
+void end_group_comms(mpistate *mpi, options opt);
+
+/* Communicator and tag for the messages of group g in an octant */
+MPI_Comm group_comm(mpistate mpi, int g);
+int group_tag(options opt, int oct, int g);
+
@@ -16,14 +16,243 @@
  */
 
 
-#ifndef WORK
-#define WORK 50
-#endif
+#include "compute.h"
+#include <omp.h>
+#include <stdlib.h>
+#include "transport.h"
 
-void compute(void) {
+/* Default working set per thread in KiB for the memory kernels */
+#define TRIAD_WSET 16384
+#define STENCIL_WSET 16
+
+/*
+ * Working set owned by a single thread.
+ * Padded so that neighbouring threads do not share a cache line.
+ */
+typedef struct workspace {
+  double *a;
+  double *b;
+  double *c;
+
+  /* Elements per array */
+  long len;
+
+  /* Element at which the next chunk of work starts */
+  long pos;
+
+  char pad[64];
+} workspace;
+
+static workspace *ws;
+static int nws;
+
+void triad(workspace *w, long n);
+void stencil(workspace *w, long n);
+void compute_angles(options opt, int oct, int c, int g, int gb, int ngb, int a0, int na, double *ybuf, double *zbuf, double *xbuf);
+
+void compute(int work) {
   volatile double x = 0.0;
-  for (int i = 0; i < WORK; i++) {
+  for (int i = 0; i < work; i++) {
     x += 1.0;
   }
 }
 
+/*
+ * Copies of compute with the amount of work fixed at build time,
+ * so the compiler can fully unroll the loop.
+ */
+#define COMPUTE_N(N) \
+  void compute_##N(void) { \
+    volatile double x = 0.0; \
+    for (int i = 0; i < N; i++) { \
+      x += 1.0; \
+    } \
+  }
+
+COMPUTE_N(8)
+COMPUTE_N(16)
+COMPUTE_N(32)
+COMPUTE_N(48)
+COMPUTE_N(64)
+
+/* Dispatch table of the specialised work sizes */
+static const struct {
+  int work;
+  void (*fn)(void);
+} compute_table[] = {
+  {8, compute_8},
+  {16, compute_16},
+  {32, compute_32},
+  {48, compute_48},
+  {64, compute_64}
+};
+
+/* Specialised flops kernel for the requested work, or NULL for the generic one */
+static void (*compute_fn)(void);
+
+/*
+ * STREAM-like triad, streaming through the working set.
+ * Each call does n elements, carrying on where the last call left off.
+ */
+void triad(workspace *w, long n) {
+  const double scalar = 3.0;
+  while (n > 0) {
+    const long len = (n < w->len - w->pos) ? n : w->len - w->pos;
+    double * restrict a = w->a + w->pos;
+    const double * restrict b = w->b + w->pos;
+    const double * restrict c = w->c + w->pos;
+    for (long e = 0; e < len; e++) {
+      a[e] = b[e] + scalar*c[e];
+    }
+    w->pos = (w->pos + len) % w->len;
+    n -= len;
+  }
+}
+
+/*
+ * Three point Jacobi stencil over a small working set which stays in cache.
+ * Each call updates n points, swapping the arrays after each full pass.
+ */
+void stencil(workspace *w, long n) {
+  const double third = 1.0/3.0;
+  const long interior = w->len - 2;
+  while (n > 0) {
+    const long len = (n < interior - w->pos) ? n : interior - w->pos;
+    const double * restrict in = w->a + w->pos;
+    double * restrict out = w->b + w->pos;
+    for (long e = 1; e <= len; e++) {
+      out[e] = third*(in[e-1] + in[e] + in[e+1]);
+    }
+    w->pos += len;
+    if (w->pos == interior) {
+      double *tmp = w->a;
+      w->a = w->b;
+      w->b = tmp;
+      w->pos = 0;
+    }
+    n -= len;
+  }
+}
+
+void init_compute(mpistate mpi, options opt) {
+  if (opt.kernel == FLOPS) {
+    compute_fn = NULL;
+    for (size_t n = 0; n < sizeof(compute_table)/sizeof(compute_table[0]); n++) {
+      if (compute_table[n].work == opt.work) {
+        compute_fn = compute_table[n].fn;
+      }
+    }
+  }
+  else if (opt.kernel == TRANSPORT) {
+    init_transport(mpi, opt);
+  }
+  else if (opt.kernel == TRIAD || opt.kernel == STENCIL) {
+    long wset = opt.wset;
+    if (wset < 1) {
+      wset = (opt.kernel == TRIAD) ? TRIAD_WSET : STENCIL_WSET;
+    }
+
+    nws = omp_get_max_threads();
+    ws = malloc(sizeof(workspace)*nws);
+
+    /* Each thread allocates and touches its own working set */
+    #pragma omp parallel
+    {
+      workspace *w = ws + omp_get_thread_num();
+      const int narrays = (opt.kernel == TRIAD) ? 3 : 2;
+      w->len = wset*1024 / (narrays*sizeof(double));
+      if (w->len < 3) w->len = 3;
+      w->pos = 0;
+      w->a = malloc(sizeof(double)*w->len);
+      w->b = malloc(sizeof(double)*w->len);
+      w->c = (narrays == 3) ? malloc(sizeof(double)*w->len) : NULL;
+      for (long e = 0; e < w->len; e++) {
+        w->a[e] = 1.0;
+        w->b[e] = 2.0;
+        if (w->c) w->c[e] = 0.5;
+      }
+    }
+  }
+}
+
+void end_compute(options opt) {
+  if (opt.kernel == TRANSPORT) {
+    end_transport();
+  }
+  else if (opt.kernel == TRIAD || opt.kernel == STENCIL) {
+    for (int t = 0; t < nws; t++) {
+      free(ws[t].a);
+      free(ws[t].b);
+      free(ws[t].c);
+    }
+    free(ws);
+  }
+}
+
+void reset_compute(options opt) {
+  if (opt.kernel == TRANSPORT) {
+    reset_transport(opt);
+  }
+}
+
+void compute_chunk(options opt, int oct, int c, int g, int gb, int ngb, double *ybuf, double *zbuf, double *xbuf) {
+  compute_angles(opt, oct, c, g, gb, ngb, 0, opt.nang, ybuf, zbuf, xbuf);
+}
+
+void compute_angle_set(options opt, int oct, int c, int s, int g, int gb, int ngb, double *ybuf, double *zbuf, double *xbuf) {
+  int a0, na;
+  angle_set(opt, s, &a0, &na);
+  compute_angles(opt, oct, c, g, gb, ngb, a0, na, ybuf, zbuf, xbuf);
+}
+
+/* The sets split the angles as evenly as possible, in order */
+void angle_set(options opt, int s, int *a0, int *na) {
+  *a0 = (int)((long)s*opt.nang / opt.angle_sets);
+  *na = (int)((long)(s+1)*opt.nang / opt.angle_sets) - *a0;
+}
+
+/* Work for the na angles from a0 of one chunk */
+void compute_angles(options opt, int oct, int c, int g, int gb, int ngb, int a0, int na, double *ybuf, double *zbuf, double *xbuf) {
+
+  /* Work is proportional to the number of cells and angles in the chunk */
+  const long ncell = (long)na*opt.chunklen*opt.ny*opt.nz;
+
+  if (opt.kernel == TRANSPORT) {
+    transport_chunk(opt, oct, c, g, gb, ngb, a0, na, ybuf, zbuf, xbuf);
+  }
+  else if (opt.kernel == TRIAD) {
+    triad(ws + omp_get_thread_num(), opt.work*ncell);
+  }
+  else if (opt.kernel == STENCIL) {
+    stencil(ws + omp_get_thread_num(), opt.work*ncell);
+  }
+  else if (compute_fn) {
+    /* Do proportional "work" */
+    for (long w = 0; w < ncell; w++) {
+      compute_fn();
+    }
+  }
+  else {
+    /* Do proportional "work" */
+    for (long w = 0; w < ncell; w++) {
+      compute(opt.work);
+    }
+  }
+}
+
+int compute_specialised(options opt) {
+  if (opt.kernel == FLOPS) {
+    return compute_fn != NULL;
+  }
+  else if (opt.kernel == TRANSPORT) {
+    return transport_specialised();
+  }
+  return 0;
+}
+
+double compute_checksum(options opt) {
+  if (opt.kernel == TRANSPORT) {
+    return transport_checksum(opt);
+  }
+  return 0.0;
+}
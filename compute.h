@@ -22,5 +22,47 @@
 
 #pragma once
 
-void compute(void);
+#include "comms.h"
+#include "options.h"
+
+/* Default amount of work per angle per cell */
+#ifndef WORK
+#define WORK 50
+#endif
+
+/* Work performed for each cell */
+enum kernel {FLOPS, TRIAD, STENCIL, TRANSPORT};
+
+void compute(int work);
+
+/* Set up and tear down any state the selected kernel needs */
+void init_compute(mpistate mpi, options opt);
+void end_compute(options opt);
+
+/* Reset any results accumulated by the kernel before a sweep */
+void reset_compute(options opt);
+
+/*
+ * Do the work for one chunk of energy group g in octant oct.
+ * The message buffers hold the faces of ngb groups, of which this is
+ * number gb; see transport.h for their layout.
+ * xbuf holds the x faces passed between ranks with a 3D decomposition,
+ * or NULL.
+ */
+void compute_chunk(options opt, int oct, int c, int g, int gb, int ngb, double *ybuf, double *zbuf, double *xbuf);
+
+/*
+ * Same as above, for just the angles in angle set s of --angle-sets.
+ * The message buffers only hold the faces for those angles.
+ */
+void compute_angle_set(options opt, int oct, int c, int s, int g, int gb, int ngb, double *ybuf, double *zbuf, double *xbuf);
+
+/* First angle, and number of angles, in angle set s */
+void angle_set(options opt, int s, int *a0, int *na);
+
+/* Whether a kernel specialised at build time for this work size or nang was selected */
+int compute_specialised(options opt);
+
+/* Sum of the results held on this rank - zero if the kernel carries no data */
+double compute_checksum(options opt);
 
@@ -0,0 +1,436 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include <omp.h>
+#include "options.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "sweep.h"
+
+/*
+ * Lock-free ring of groups with a single producer and a single consumer.
+ * The producer only writes tail and the consumer only writes head, each
+ * on its own cache line, and both only ever increase. Holds up to mask+1
+ * entries.
+ */
+typedef struct spsc_ring {
+  int *item;
+  int mask;
+  char pad0[64];
+  int head;
+  char pad1[64];
+  int tail;
+  char pad2[64];
+} spsc_ring;
+
+/* Progress of one group's messages, only touched by the comm thread */
+typedef struct funneled_group {
+  /* Next chunk to receive, and chunks sent, counting through all the octants */
+  int recvstep;
+  int sendstep;
+
+  /* Whether the receives for the next chunk have been posted */
+  int posted;
+
+  /* Receives of the y, z and, on the first chunk, x faces */
+  MPI_Request recv[3];
+
+  /* Sends from each of the two buffers, and of the x face */
+  MPI_Request send[2][2];
+  MPI_Request xsend;
+} funneled_group;
+
+/*
+ * Message buffers, rings, group states and each compute thread's steps,
+ * kept between sweeps until the face sizes, the number of groups or the
+ * number of threads change. All but the buffers are reset by each sweep.
+ */
+typedef struct funneled_context {
+  int ycount, zcount, xcount, ng, nthrds;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf;
+  spsc_ring *arrived;
+  spsc_ring *ready;
+  funneled_group *state;
+  int **step;
+} funneled_context;
+
+static funneled_context *context = NULL;
+
+void init_funneled_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_funneled_sweep(double **ybuf, double **zbuf, double *xbuf);
+void init_spsc_ring(spsc_ring *r, int n);
+void end_spsc_ring(spsc_ring *r);
+int ring_push(spsc_ring *r, int g);
+int ring_pop(spsc_ring *r, int *g);
+
+/*
+ * Perform a KBA sweep using OpenMP threads for concurrent group sweeps,
+ * with every MPI call made by the master thread.
+ *
+ * Thread 0 only communicates, and the other threads only compute, each
+ * sweeping its own share of the groups. A compute thread takes the chunks
+ * whose faces have arrived from one ring, sweeps them, and puts them on a
+ * second ring for the comm thread to send. The comm thread posts each
+ * group's receives for the next chunk once the buffer is free again, and
+ * hands the group back when they complete. Each ring has a single producer
+ * and a single consumer, so no locks are needed, and only MPI_THREAD_FUNNELED
+ * is required.
+ */
+timings funneled_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  /* Check MPI threading model is high enough */
+  if (mpi.thread_support < MPI_THREAD_FUNNELED) {
+    if (mpi.rank == 0) {
+      printf("MPI library must support MPI_THREAD_FUNNELED\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+
+  /* Message buffers, rings and group states, built before the first sweep */
+  init_funneled_context(mpi, opt);
+  const int nthrds = context->nthrds;
+  if (nthrds < 2) {
+    if (mpi.rank == 0) {
+      printf("Funneled sweeper needs at least two OpenMP threads\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_Barrier(mpi.comm);
+  }
+  const int nworkers = nthrds - 1;
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double *xbuf = context->xbuf;
+  spsc_ring *arrived = context->arrived;
+  spsc_ring *ready = context->ready;
+  funneled_group *state = context->state;
+  int **step = context->step;
+
+  time.setup = MPI_Wtime();
+
+  /* Rings are empty between sweeps, so start them from the beginning again */
+  for (int w = 0; w < nworkers; w++) {
+    arrived[w].head = arrived[w].tail = 0;
+    ready[w].head = ready[w].tail = 0;
+  }
+
+  for (int g = 0; g < opt.ng; g++) {
+    step[g%nworkers][g/nworkers] = 0;
+    state[g].recvstep = 0;
+    state[g].sendstep = 0;
+    state[g].posted = 0;
+    for (int b = 0; b < 2; b++) {
+      state[g].send[b][0] = MPI_REQUEST_NULL;
+      state[g].send[b][1] = MPI_REQUEST_NULL;
+    }
+    state[g].recv[2] = MPI_REQUEST_NULL;
+    state[g].xsend = MPI_REQUEST_NULL;
+  }
+
+  const int nsteps = 8 * opt.nchunks;
+  time.setup = MPI_Wtime() - time.setup;
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+#pragma omp parallel
+{
+  const int thrd = omp_get_thread_num();
+
+  if (thrd == 0) {
+
+    /* Number of groups to have sent each octant, to keep the octants in step unless pipelining */
+    int octdone[8] = {0};
+
+    /* Groups still sweeping */
+    int remaining = opt.ng;
+
+    while (remaining > 0) {
+
+      /* Send the chunks the compute threads have finished */
+      for (int w = 0; w < nworkers; w++) {
+        int g;
+        while (ring_pop(ready + w, &g)) {
+          funneled_group *gs = state + g;
+          const int t = gs->sendstep;
+          const int o = t / opt.nchunks;
+          const int c = t % opt.nchunks;
+          const int oct = octant_order[opt.octants][o];
+          const int i = oct & 1;
+          const int j = (oct >> 1) & 1;
+          const int k = (oct >> 2) & 1;
+          const int buf = t % 2;
+          const int tag = group_tag(opt, oct, g);
+          const MPI_Comm comm = group_comm(mpi, g);
+
+          MPI_Isend(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, (j == 0) ? mpi.ylo : mpi.yhi, tag, comm, gs->send[buf]+0);
+          MPI_Isend(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, (k == 0) ? mpi.zlo : mpi.zhi, tag, comm, gs->send[buf]+1);
+          if (c == opt.nchunks-1) {
+            MPI_Isend(xbuf+g*xcount, xcount, MPI_DOUBLE, (i == 0) ? mpi.xlo : mpi.xhi, tag, comm, &gs->xsend);
+            octdone[o]++;
+          }
+
+          gs->sendstep++;
+          if (gs->sendstep == nsteps) remaining--;
+        }
+      }
+
+      /* Post and complete the receives for each group's next chunk */
+      for (int g = 0; g < opt.ng; g++) {
+        funneled_group *gs = state + g;
+        const int t = gs->recvstep;
+        if (t == nsteps) continue;
+
+        const int o = t / opt.nchunks;
+        const int c = t % opt.nchunks;
+        const int oct = octant_order[opt.octants][o];
+        const int buf = t % 2;
+
+        if (!gs->posted) {
+          /*
+           * The buffer is free once the chunk two ago has been sent from it,
+           * and the x face once the last octant's has gone. Unless pipelining,
+           * an octant starts once every group has finished the one before.
+           */
+          if (gs->sendstep < t - 1) continue;
+          if (c == 0 && gs->sendstep < t) continue;
+          if (c == 0 && o > 0 && opt.octants != PIPELINED_OCTANTS && octdone[o-1] < opt.ng) continue;
+
+          int sent;
+          MPI_Testall(2, gs->send[buf], &sent, MPI_STATUSES_IGNORE);
+          if (sent && c == 0) {
+            MPI_Test(&gs->xsend, &sent, MPI_STATUS_IGNORE);
+          }
+          if (!sent) continue;
+
+          const int i = oct & 1;
+          const int j = (oct >> 1) & 1;
+          const int k = (oct >> 2) & 1;
+          const int tag = group_tag(opt, oct, g);
+          const MPI_Comm comm = group_comm(mpi, g);
+          MPI_Irecv(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, (j == 0) ? mpi.yhi : mpi.ylo, tag, comm, gs->recv+0);
+          MPI_Irecv(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, (k == 0) ? mpi.zhi : mpi.zlo, tag, comm, gs->recv+1);
+          if (c == 0) {
+            MPI_Irecv(xbuf+g*xcount, xcount, MPI_DOUBLE, (i == 0) ? mpi.xhi : mpi.xlo, tag, comm, gs->recv+2);
+          }
+          gs->posted = 1;
+        }
+
+        int done;
+        MPI_Testall(3, gs->recv, &done, MPI_STATUSES_IGNORE);
+        if (done) {
+          /* Room is always left for this group's chunk - dropping it would hang its worker */
+          if (!ring_push(arrived + g%nworkers, g)) {
+            printf("Funneled sweeper ring of arrived groups overflowed\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+          }
+          gs->posted = 0;
+          gs->recvstep++;
+        }
+      }
+    }
+
+    /* Make sure the last faces have gone before the buffers are used again */
+    for (int g = 0; g < opt.ng; g++) {
+      MPI_Waitall(4, state[g].send[0], MPI_STATUSES_IGNORE);
+      MPI_Wait(&state[g].xsend, MPI_STATUS_IGNORE);
+    }
+  }
+  else {
+
+    /* Compute thread - sweeps the groups g with g%nworkers == w */
+    const int w = thrd - 1;
+    int *mine = step[w];
+    int todo = 0;
+    for (int g = w; g < opt.ng; g += nworkers) todo += nsteps;
+
+    double waiting = 0.0;
+    while (todo > 0) {
+      int g;
+      if (!ring_pop(arrived + w, &g)) {
+        /* Only the comm thread calls MPI, so time the wait with OpenMP */
+        double comtime = omp_get_wtime();
+        while (!ring_pop(arrived + w, &g));
+        waiting += omp_get_wtime() - comtime;
+      }
+
+      const int t = mine[g/nworkers]++;
+      const int o = t / opt.nchunks;
+      const int c = t % opt.nchunks;
+      const int oct = octant_order[opt.octants][o];
+      const int buf = t % 2;
+
+      /* Do proportional "work" */
+      compute_chunk(opt, oct, c, g, 0, 1, ybuf[buf]+g*ycount, zbuf[buf]+g*zcount, xbuf+g*xcount);
+
+      /* Hand the chunk to the comm thread to send */
+      while (!ring_push(ready + w, g));
+      todo--;
+    }
+
+    /* Just time last thread - waiting for faces stands in for comms */
+    if (thrd == nthrds-1) {
+      time.comms = waiting;
+    }
+  }
+} /* End parallel region */
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/* Ring with room for at least n entries */
+void init_spsc_ring(spsc_ring *r, int n) {
+  int cap = 1;
+  while (cap < n) cap *= 2;
+  r->item = malloc(sizeof(int)*cap);
+  r->mask = cap - 1;
+  r->head = 0;
+  r->tail = 0;
+}
+
+void end_spsc_ring(spsc_ring *r) {
+  free(r->item);
+}
+
+/* Add a group at the tail, or return 0 if the ring is full */
+int ring_push(spsc_ring *r, int g) {
+  int head;
+  #pragma omp atomic read seq_cst
+  head = r->head;
+  const int tail = r->tail;
+  if (tail - head > r->mask) return 0;
+
+  r->item[tail & r->mask] = g;
+  #pragma omp atomic write seq_cst
+  r->tail = tail + 1;
+  return 1;
+}
+
+/* Take the group at the head, or return 0 if the ring is empty */
+int ring_pop(spsc_ring *r, int *g) {
+  int tail;
+  #pragma omp atomic read seq_cst
+  tail = r->tail;
+  const int head = r->head;
+  if (head == tail) return 0;
+
+  *g = r->item[head & r->mask];
+  #pragma omp atomic write seq_cst
+  r->head = head + 1;
+  return 1;
+}
+
+/* Allocate MPI message buffers */
+void init_funneled_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  *xbuf = malloc(sizeof(double)*xcount);
+}
+
+/* Free MPI message buffers */
+void end_funneled_sweep(double **ybuf, double **zbuf, double *xbuf) {
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  free(xbuf);
+}
+
+
+/*
+ * Build the message buffers - two of each so that a receive never lands
+ * in a buffer which is still being sent from, and one for the x face -
+ * the rings between the comm thread and each compute thread, the group
+ * states, and each compute thread's next step for its own groups, unless
+ * those from an earlier sweep are still right.
+ * A group has at most two chunks in flight, so a ring never holds more
+ * than 2*ng entries.
+ */
+void init_funneled_context(mpistate mpi, options opt) {
+  (void)mpi;
+  int nthrds;
+  #pragma omp parallel
+  {
+    nthrds = omp_get_num_threads();
+  }
+
+  const int ycount = opt.nang * opt.nz * opt.chunklen;
+  const int zcount = opt.nang * opt.ny * opt.chunklen;
+  const int xcount = opt.nang * opt.ny * opt.nz;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->ng == opt.ng && context->nthrds == nthrds) return;
+    end_funneled_context();
+  }
+
+  context = malloc(sizeof(funneled_context));
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->ng = opt.ng;
+  context->nthrds = nthrds;
+  init_funneled_sweep(opt.ng*ycount, opt.ng*zcount, opt.ng*xcount, context->ybuf, context->zbuf, &context->xbuf);
+
+  const int nworkers = nthrds - 1;
+  context->arrived = malloc(sizeof(spsc_ring)*nworkers);
+  context->ready = malloc(sizeof(spsc_ring)*nworkers);
+  context->step = malloc(sizeof(int *)*nworkers);
+  for (int w = 0; w < nworkers; w++) {
+    init_spsc_ring(context->arrived + w, 2*opt.ng);
+    init_spsc_ring(context->ready + w, 2*opt.ng);
+    context->step[w] = malloc(sizeof(int)*(opt.ng/nworkers + 1));
+  }
+  context->state = malloc(sizeof(funneled_group)*opt.ng);
+}
+
+/* Free the message buffers, rings, group states and steps */
+void end_funneled_context(void) {
+  if (!context) return;
+
+  for (int w = 0; w < context->nthrds-1; w++) {
+    end_spsc_ring(context->arrived + w);
+    end_spsc_ring(context->ready + w);
+    free(context->step[w]);
+  }
+  free(context->arrived);
+  free(context->ready);
+  free(context->step);
+  free(context->state);
+  end_funneled_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context);
+  context = NULL;
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <limits.h>
+#include "model.h"
+#include <mpi.h>
+#include <omp.h>
+#include "options.h"
+#include "pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "sweep.h"
+
+double ping_pong(MPI_Comm comm, int partner, int lead, char *buf, int bytes);
+void measure_links(MPI_Comm comm, int coord, int lo, int hi, char *buf, int bytes, double *small, double *large);
+
+perfmodel measure_model(mpistate mpi, options opt) {
+
+  perfmodel model = {
+    .latency = 0.0,
+    .gap = 0.0,
+    .cellcost = 0.0
+  };
+
+  /*
+   * Large messages are the size of a face for all groups, taking the
+   * largest on any rank so both ends of a link agree when the mesh does
+   * not divide evenly. The gap is a slope, so a face too big for one
+   * message is measured with the largest message MPI can count.
+   */
+  const int face = (opt.ny > opt.nz) ? opt.ny : opt.nz;
+  const long facebytes = (long)sizeof(double) * opt.nang * face * opt.chunklen * opt.ng;
+  long maxbytes;
+  MPI_Allreduce(&facebytes, &maxbytes, 1, MPI_LONG, MPI_MAX, mpi.comm);
+  const int bytes = (maxbytes > INT_MAX) ? INT_MAX : (int)maxbytes;
+  char *buf = calloc(bytes, 1);
+
+  /* Slowest one way times to any neighbour, for small and large messages */
+  double small = 0.0;
+  double large = 0.0;
+  measure_links(mpi.comm, mpi.x, mpi.xlo, mpi.xhi, buf, bytes, &small, &large);
+  measure_links(mpi.comm, mpi.y, mpi.ylo, mpi.yhi, buf, bytes, &small, &large);
+  measure_links(mpi.comm, mpi.z, mpi.zlo, mpi.zhi, buf, bytes, &small, &large);
+  free(buf);
+
+  double local[2] = {small, large};
+  double slowest[2];
+  MPI_Allreduce(local, slowest, 2, MPI_DOUBLE, MPI_MAX, mpi.comm);
+  model.latency = slowest[0];
+  if (bytes > 1 && slowest[1] > slowest[0]) {
+    model.gap = (slowest[1] - slowest[0]) / (bytes - 1);
+  }
+
+  /*
+   * Time a chunk of every group on one thread with empty faces.
+   * Any flux this accumulates is cleared before each sweep.
+   */
+  double *ybuf = calloc(face_array_count(opt, Y_FACE), sizeof(double));
+  double *zbuf = calloc(face_array_count(opt, Z_FACE), sizeof(double));
+  double best = 0.0;
+  for (int r = 0; r < MODEL_REPS; r++) {
+    double tick = MPI_Wtime();
+    for (int g = 0; g < opt.ng; g++) {
+      compute_chunk(opt, 0, 0, g, g, opt.ng, ybuf, zbuf, NULL);
+    }
+    double t = MPI_Wtime() - tick;
+    if (r == 0 || t < best) best = t;
+  }
+  free(ybuf);
+  free(zbuf);
+
+  const double cost = best / ((double)opt.chunklen * opt.ny * opt.nz * opt.ng);
+  MPI_Allreduce(&cost, &model.cellcost, 1, MPI_DOUBLE, MPI_MAX, mpi.comm);
+
+  return model;
+}
+
+void print_model(mpistate mpi, options opt, perfmodel model, timings *times, int threaded, int msgs) {
+
+  if (mpi.rank != 0) return;
+
+  /* Fastest measured sweep, as reported in the timings */
+  int min = 0;
+  for (int s = 1; s < opt.nsweeps; s++) {
+    if (times[s].sweeping < times[min].sweeping) min = s;
+  }
+
+  /* Compute for a chunk of all groups, with the groups shared evenly between threads */
+  const int nthrds = threaded ? omp_get_max_threads() : 1;
+  const int rounds = (opt.ng + nthrds - 1) / nthrds;
+  const double tcompute = model.cellcost * opt.chunklen * opt.ny * opt.nz * rounds;
+
+  /* Pass the y and z faces of a chunk downwind, split into msgs messages each */
+  const double ybytes = sizeof(double) * opt.nang * opt.nz * opt.chunklen * opt.ng;
+  const double zbytes = sizeof(double) * opt.nang * opt.ny * opt.chunklen * opt.ng;
+  const double tcomms = 2*msgs*model.latency + model.gap*(ybytes + zbytes);
+
+  /*
+   * Each octant is nchunks stages on every rank. A sweep starting from a
+   * new corner must first cross npey+npez-2 ranks before the far corner
+   * can start, and each rank in x must finish all its chunks before the
+   * next can start. The pipelined octant order only refills the pipeline
+   * for each pair of octants.
+   */
+  const int depth = mpi.npey + mpi.npez - 2 + (mpi.npex - 1) * opt.nchunks;
+  const int nfills = (opt.octants == PIPELINED_OCTANTS) ? 4 : 8;
+  const double fill = nfills * depth * tcompute;
+  const double steady = 8.0 * opt.nchunks * tcompute;
+  const double comms = (nfills * depth + 8.0 * opt.nchunks) * tcomms;
+
+  printf("Performance model\n");
+  printf("  Latency:         %11.3lf us\n", model.latency*1.0e6);
+  printf("  Bandwidth:       %11.3lf MB/s\n", (model.gap > 0.0) ? 1.0e-6/model.gap : 0.0);
+  printf("  Cell cost:       %11.3lf ns per group\n", model.cellcost*1.0e9);
+  printf("  Pipeline depth:  %11d stages\n", depth+1);
+  printf("  Predicted sweep: %11.6lf s\n", fill + steady + comms);
+  printf("    Fill:          %11.6lf s\n", fill);
+  printf("    Steady state:  %11.6lf s\n", steady);
+  printf("    Comms:         %11.6lf s\n", comms);
+  printf("  Measured sweep:  %11.6lf s\n", times[min].sweeping);
+  printf("    Compute:       %11.6lf s\n", times[min].sweeping - times[min].comms);
+  printf("    Comms:         %11.6lf s\n", times[min].comms);
+  printf("====================\n");
+  printf("\n");
+}
+
+/*
+ * Smaller bundles let the downwind rank start sooner, so the pipeline fills
+ * in fewer group sweeps, but each costs another latency per face. Each
+ * bundle is a pipeline stage of its compute and its messages, and the sweep
+ * is the stages to fill the pipeline and then those of all the chunks.
+ */
+int model_groups_per_msg(mpistate mpi, options opt, perfmodel model) {
+  const int nthrds = omp_get_max_threads();
+  const double ybytes = sizeof(double) * opt.nang * opt.nz * opt.chunklen;
+  const double zbytes = sizeof(double) * opt.nang * opt.ny * opt.chunklen;
+  const int depth = mpi.npey + mpi.npez - 2 + (mpi.npex - 1) * opt.nchunks;
+  const int nfills = (opt.octants == PIPELINED_OCTANTS) ? 4 : 8;
+
+  int best = opt.ng;
+  double fastest = 0.0;
+  for (int gpm = 1; gpm <= opt.ng; gpm++) {
+    const int nbundles = (opt.ng + gpm - 1) / gpm;
+    const int rounds = (gpm + nthrds - 1) / nthrds;
+    const double tcompute = model.cellcost * opt.chunklen * opt.ny * opt.nz * rounds;
+    const double tcomms = 2*model.latency + model.gap*(ybytes + zbytes)*gpm;
+    const double t = (nfills * depth + 8.0 * opt.nchunks * nbundles) * (tcompute + tcomms);
+    if (gpm == 1 || t < fastest) {
+      best = gpm;
+      fastest = t;
+    }
+  }
+
+  /* Subdomains may differ in size, so take rank 0's choice */
+  MPI_Bcast(&best, 1, MPI_INT, 0, mpi.comm);
+  return best;
+}
+
+/* One way time of a message to partner and back, with lead sending first */
+double ping_pong(MPI_Comm comm, int partner, int lead, char *buf, int bytes) {
+  double best = 0.0;
+  for (int r = 0; r < MODEL_REPS; r++) {
+    double tick = MPI_Wtime();
+    if (lead) {
+      MPI_Send(buf, bytes, MPI_BYTE, partner, 0, comm);
+      MPI_Recv(buf, bytes, MPI_BYTE, partner, 0, comm, MPI_STATUS_IGNORE);
+    }
+    else {
+      MPI_Recv(buf, bytes, MPI_BYTE, partner, 0, comm, MPI_STATUS_IGNORE);
+      MPI_Send(buf, bytes, MPI_BYTE, partner, 0, comm);
+    }
+    double t = (MPI_Wtime() - tick) / 2.0;
+    if (r == 0 || t < best) best = t;
+  }
+  return best;
+}
+
+/*
+ * Ping-pong with both neighbours along one dimension, keeping the slowest times.
+ * Even coordinates pair with the hi neighbour first and odd ones with the lo
+ * neighbour, and then the other way round, so every link is timed once and
+ * the ranks always agree on who they are paired with.
+ */
+void measure_links(MPI_Comm comm, int coord, int lo, int hi, char *buf, int bytes, double *small, double *large) {
+  for (int phase = 0; phase < 2; phase++) {
+    const int lead = (coord % 2 == phase);
+    const int partner = lead ? hi : lo;
+    if (partner == MPI_PROC_NULL) continue;
+
+    double t = ping_pong(comm, partner, lead, buf, 1);
+    if (t > *small) *small = t;
+    t = ping_pong(comm, partner, lead, buf, bytes);
+    if (t > *large) *large = t;
+  }
+}
@@ -0,0 +1,67 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Analytic KBA performance model
+ * A LogGP style model of the network, measured between neighbouring
+ * ranks, is combined with the measured cost of computing a cell and
+ * the depth of the pipeline to predict the sweep time.
+ */
+
+#pragma once
+
+#include "comms.h"
+#include "options.h"
+#include "sweep.h"
+
+/* Repetitions of each measurement - the fastest is kept */
+#ifndef MODEL_REPS
+#define MODEL_REPS 10
+#endif
+
+typedef struct perfmodel {
+  /* One way time for a small message between neighbours, in seconds */
+  double latency;
+
+  /* Additional time per byte for a large message, in seconds */
+  double gap;
+
+  /* Time to compute one cell of one group on one thread, in seconds */
+  double cellcost;
+
+} perfmodel;
+
+/*
+ * Measure the model parameters on every rank, keeping the slowest.
+ * Must be called by all ranks after the compute state is set up.
+ */
+perfmodel measure_model(mpistate mpi, options opt);
+
+/*
+ * Print the predicted sweep time next to the fastest measured sweep,
+ * split into pipeline fill, steady state and communication.
+ * threaded is whether groups are shared between threads, and msgs is
+ * the number of messages each face is sent in per chunk.
+ */
+void print_model(mpistate mpi, options opt, perfmodel model, timings *times, int threaded, int msgs);
+
+/*
+ * Number of groups to send in each message, for the bundled sweeper,
+ * with the shortest predicted sweep. Every rank returns the same value.
+ */
+int model_groups_per_msg(mpistate mpi, options opt, perfmodel model);
@@ -0,0 +1,262 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include "options.h"
+#include <stdlib.h>
+#include "sweep.h"
+
+/* Number of YZ corners, each starting one sweep front */
+#define NFRONTS 4
+
+void init_multi_corner_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_multi_corner_sweep(double **ybuf, double **zbuf, double **xbuf);
+int front_priority(mpistate mpi, options opt, int f, int s);
+
+/* Message buffers kept between sweeps until the face sizes change */
+typedef struct multi_corner_context {
+  int ycount, zcount, xcount;
+  double *ybuf[NFRONTS*2];
+  double *zbuf[NFRONTS*2];
+  double *xbuf[NFRONTS];
+} multi_corner_context;
+
+static multi_corner_context *context = NULL;
+
+/*
+ * Perform the sweeps from all four YZ corners at once, threading over
+ * groups inside the chunk.
+ * Front f starts from the corner with y direction f&1 and z direction f>>1,
+ * and sweeps its two octants back to back, one in each x direction.
+ * Each front is a sequence of stages, one per chunk of each octant.
+ * Whenever a chunk has finished, the ready stage with the highest
+ * priority is run next.
+ */
+timings multi_corner_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  /*
+   * Message buffers - two of each per front so that the receive for the
+   * next stage can be posted while the previous face is still being sent,
+   * and one for the x face
+   */
+  init_multi_corner_context(mpi, opt);
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double **xbuf = context->xbuf;
+
+  /* Upwind and downwind neighbours of each front */
+  int yup[NFRONTS], ydown[NFRONTS], zup[NFRONTS], zdown[NFRONTS];
+  for (int f = 0; f < NFRONTS; f++) {
+    const int j = f & 1;
+    const int k = f >> 1;
+    yup[f] = (j == 0) ? mpi.yhi : mpi.ylo;
+    ydown[f] = (j == 0) ? mpi.ylo : mpi.yhi;
+    zup[f] = (k == 0) ? mpi.zhi : mpi.zlo;
+    zdown[f] = (k == 0) ? mpi.zlo : mpi.zhi;
+  }
+
+  /*
+   * Receive requests per front, including the x face on the first chunk of
+   * an octant, and send requests per front and buffer, plus the x face
+   */
+  MPI_Request recvreq[NFRONTS][3];
+  MPI_Request sendreq[NFRONTS][2][2];
+  MPI_Request xsendreq[NFRONTS];
+  for (int f = 0; f < NFRONTS; f++) {
+    for (int b = 0; b < 2; b++) {
+      sendreq[f][b][0] = MPI_REQUEST_NULL;
+      sendreq[f][b][1] = MPI_REQUEST_NULL;
+    }
+    recvreq[f][2] = MPI_REQUEST_NULL;
+    xsendreq[f] = MPI_REQUEST_NULL;
+  }
+
+  /* Next stage of each front, and whether its receives have been posted */
+  const int nstages = 2 * opt.nchunks;
+  int stage[NFRONTS] = {0};
+  int posted[NFRONTS] = {0};
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+  for (int remaining = NFRONTS*nstages; remaining > 0; remaining--) {
+
+    /*
+     * Wait until a front is ready, and pick the one with the highest priority.
+     * A front's receives go into the buffer it sent from two stages ago,
+     * so are only posted once that send has completed, and likewise for
+     * the x face at the start of each octant. Testing rather than
+     * waiting here means a slow send never holds up the other fronts.
+     * Messages are tagged with the front, as a neighbour may be upwind of
+     * this rank in two fronts at once.
+     */
+    double comtime = MPI_Wtime();
+    int f = -1;
+    while (f < 0) {
+      for (int n = 0; n < NFRONTS; n++) {
+        if (stage[n] == nstages) continue;
+        if (!posted[n]) {
+          const int first = (stage[n] % opt.nchunks == 0);
+          int sent;
+          MPI_Testall(2, sendreq[n][stage[n]%2], &sent, MPI_STATUSES_IGNORE);
+          if (sent && first) {
+            MPI_Test(&xsendreq[n], &sent, MPI_STATUS_IGNORE);
+          }
+          if (!sent) continue;
+          const int nb = 2*n + stage[n]%2;
+          MPI_Irecv(ybuf[nb], ycount, MPI_DOUBLE, yup[n], n, mpi.comm, &recvreq[n][0]);
+          MPI_Irecv(zbuf[nb], zcount, MPI_DOUBLE, zup[n], n, mpi.comm, &recvreq[n][1]);
+          if (first) {
+            const int xup = (stage[n] < opt.nchunks) ? mpi.xhi : mpi.xlo;
+            MPI_Irecv(xbuf[n], xcount, MPI_DOUBLE, xup, n, mpi.comm, &recvreq[n][2]);
+          }
+          posted[n] = 1;
+        }
+        int arrived;
+        MPI_Testall(3, recvreq[n], &arrived, MPI_STATUSES_IGNORE);
+        if (arrived && (f < 0 || front_priority(mpi, opt, n, stage[n]) > front_priority(mpi, opt, f, stage[f]))) {
+          f = n;
+        }
+      }
+    }
+    time.comms += MPI_Wtime() - comtime;
+
+    /* Octant and chunk of this stage */
+    const int s = stage[f];
+    const int b = 2*f + s%2;
+    const int oct = (s / opt.nchunks) + 2*f;
+    const int c = s % opt.nchunks;
+
+    #pragma omp parallel for
+    for (int g = 0; g < opt.ng; g++) {
+
+      /* Do proportional "work" */
+      compute_chunk(opt, oct, c, g, g, opt.ng, ybuf[b], zbuf[b], xbuf[f]);
+
+    } /* End group loop */
+
+    /* Send payload to downwind neighbours */
+    comtime = MPI_Wtime();
+    MPI_Isend(ybuf[b], ycount, MPI_DOUBLE, ydown[f], f, mpi.comm, &sendreq[f][s%2][0]);
+    MPI_Isend(zbuf[b], zcount, MPI_DOUBLE, zdown[f], f, mpi.comm, &sendreq[f][s%2][1]);
+    if (c == opt.nchunks-1) {
+      const int xdown = (s < opt.nchunks) ? mpi.xlo : mpi.xhi;
+      MPI_Isend(xbuf[f], xcount, MPI_DOUBLE, xdown, f, mpi.comm, &xsendreq[f]);
+    }
+    stage[f]++;
+    posted[f] = 0;
+    time.comms += MPI_Wtime() - comtime;
+
+  } /* End stage loop */
+
+  /* Make sure the last faces have gone before the buffers are used again */
+  double comtime = MPI_Wtime();
+  MPI_Waitall(NFRONTS*4, &sendreq[0][0][0], MPI_STATUSES_IGNORE);
+  MPI_Waitall(NFRONTS, xsendreq, MPI_STATUSES_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/*
+ * Priority of running stage s of front f next - the highest goes first.
+ * Depth first favours the front with the most ranks still downwind of
+ * this one, as they are waiting on it.
+ * Earliest start favours the stage which could have started first in an
+ * ideal pipeline, counting the ranks upwind of this one and the stages
+ * already done.
+ */
+int front_priority(mpistate mpi, options opt, int f, int s) {
+  const int j = f & 1;
+  const int k = f >> 1;
+  const int ydist = (j == 0) ? mpi.y : mpi.npey-1-mpi.y;
+  const int zdist = (k == 0) ? mpi.z : mpi.npez-1-mpi.z;
+
+  if (opt.priority == DEPTH_PRIORITY) {
+    return ydist + zdist;
+  }
+  else {
+    return -((mpi.npey-1-ydist) + (mpi.npez-1-zdist) + s);
+  }
+}
+
+/* Allocate MPI message buffers */
+void init_multi_corner_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < NFRONTS*2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  for (int f = 0; f < NFRONTS; f++) {
+    xbuf[f] = malloc(sizeof(double)*xcount);
+  }
+}
+
+/* Free MPI message buffers */
+void end_multi_corner_sweep(double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < NFRONTS*2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  for (int f = 0; f < NFRONTS; f++) {
+    free(xbuf[f]);
+  }
+}
+
+
+/* Build the message buffers, unless those from an earlier sweep are the same size */
+void init_multi_corner_context(mpistate mpi, options opt) {
+  (void)mpi;
+  const int ycount = opt.nang * opt.nz * opt.chunklen * opt.ng;
+  const int zcount = opt.nang * opt.ny * opt.chunklen * opt.ng;
+  const int xcount = opt.nang * opt.ny * opt.nz * opt.ng;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount) return;
+    end_multi_corner_context();
+  }
+
+  context = malloc(sizeof(multi_corner_context));
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  init_multi_corner_sweep(ycount, zcount, xcount, context->ybuf, context->zbuf, context->xbuf);
+}
+
+/* Free the message buffers */
+void end_multi_corner_context(void) {
+  if (!context) return;
+
+  end_multi_corner_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context);
+  context = NULL;
+}
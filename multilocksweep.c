@@ -25,10 +25,67 @@
 #include <stdlib.h>
 #include "sweep.h"
 
-void init_par_mpi_multi_lock_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf);
-void end_par_mpi_multi_lock_sweep(double *ybuf, double *zbuf);
+/*
+ * Double ended queue of groups, one per thread.
+ * The owner pushes and pops at the bottom, and other threads steal from the top.
+ * Stored as a ring of cap entries starting at head.
+ */
+typedef struct deque {
+  int *item;
+  int head;
+  int count;
+  int cap;
+  omp_lock_t lock;
+} deque;
+
+/* Progress of one group's sweep through the octants and chunks */
+typedef struct groupstate {
+  /* Next chunk to sweep, counting through all the octants */
+  int step;
+
+  /* Whether the receives for the next chunk have been posted */
+  int posted;
+
+  /* Receives of the y, z and, on the first chunk, x faces */
+  MPI_Request recv[3];
+
+  /* Sends from each of the two buffers, and of the x face */
+  MPI_Request send[2][2];
+  MPI_Request xsend;
+} groupstate;
+
+/*
+ * Message buffers, queues and group states kept between sweeps until the
+ * face sizes, the number of groups or the number of threads change.
+ * The queues and group states are filled afresh by each sweep.
+ */
+typedef struct multi_lock_context {
+  int ycount, zcount, xcount, ng, nthrds;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf;
+  deque *queue;
+  groupstate *state;
+} multi_lock_context;
+
+static multi_lock_context *context = NULL;
+
+void init_par_mpi_multi_lock_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_par_mpi_multi_lock_sweep(double **ybuf, double **zbuf, double *xbuf);
+void deque_push_bottom(deque *q, int g);
+void deque_push_top(deque *q, int g);
+int deque_pop_bottom(deque *q);
+int deque_steal_top(deque *q);
+void take_turn(long *ticket, long *serving);
+void end_turn(long *serving);
 
-/* Perform a KBA sweep using OpenMP threads for concurrent group sweeps */
+/*
+ * Perform a KBA sweep using OpenMP threads for concurrent group sweeps.
+ * Each group is a work item which threads keep in their own deque and
+ * steal from each other when idle. A thread runs the next chunk of a
+ * group if its faces have arrived, otherwise it puts the group back and
+ * moves on, so no thread ever waits on a message while other work is ready.
+ */
 timings par_mpi_multi_lock_sweep(mpistate mpi, options opt) {
 
   timings time = {
@@ -37,8 +94,6 @@ timings par_mpi_multi_lock_sweep(mpistate mpi, options opt) {
     .comms = 0.0
   };
 
-  time.setup = MPI_Wtime();
-
   /* Check MPI threading model is high enough */
   if (mpi.thread_support < MPI_THREAD_SERIALIZED) {
     if (mpi.rank == 0) {
@@ -47,178 +102,337 @@ timings par_mpi_multi_lock_sweep(mpistate mpi, options opt) {
     }
   }
 
-  /*
-   * Need to use OpenMP locks if we are only MPI_THREAD_SERIALIZED.
-   * We must ensure only one thread calls at once, and we cannot
-   * use the if clause on a critial region, so we implement this
-   * manually with locks.
-   * Only one lock should be required
-   */
-  int nthrds;
-  #pragma omp parallel
-  {
-    nthrds = omp_get_num_threads();
-  } 
+  /* Message buffers, queues and group states, built before the first sweep */
+  init_par_mpi_multi_lock_context(mpi, opt);
+  const int nthrds = context->nthrds;
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double *xbuf = context->xbuf;
+  deque *queue = context->queue;
+  groupstate *state = context->state;
+
+  time.setup = MPI_Wtime();
+
+  /* Deal the groups out between the threads */
+  for (int t = 0; t < nthrds; t++) {
+    queue[t].head = 0;
+    queue[t].count = 0;
+  }
+  for (int g = opt.ng-1; g >= 0; g--) {
+    deque_push_bottom(queue + g%nthrds, g);
+  }
 
-  omp_lock_t *lock = malloc(sizeof(omp_lock_t)*nthrds);
-  if (mpi.thread_support == MPI_THREAD_SERIALIZED) {
-    for (int l = 0; l < nthrds; l++)
-      omp_init_lock(lock+l);
+  for (int g = 0; g < opt.ng; g++) {
+    state[g].step = 0;
+    state[g].posted = 0;
+    for (int b = 0; b < 2; b++) {
+      state[g].send[b][0] = MPI_REQUEST_NULL;
+      state[g].send[b][1] = MPI_REQUEST_NULL;
+    }
+    state[g].recv[2] = MPI_REQUEST_NULL;
+    state[g].xsend = MPI_REQUEST_NULL;
   }
 
-  /* Message buffers */
-  const int ycount = opt.nang * opt.nz * opt.chunklen;
-  const int zcount = opt.nang * opt.ny * opt.chunklen;
-  double *ybuf;
-  double *zbuf;
-  init_par_mpi_multi_lock_sweep(opt.ng*ycount, opt.ng*zcount, &ybuf, &zbuf);
+  /* Number of groups to have finished each octant, to keep the octants in step unless pipelining */
+  int octdone[8] = {0};
+
+  /* Groups still sweeping */
+  int remaining = opt.ng;
+
+  /*
+   * Turn taking for MPI if we are only MPI_THREAD_SERIALIZED.
+   * A thread takes the next ticket and waits for it to be served,
+   * so threads are given the turn in the order they asked for it.
+   */
+  long ticket = 0;
+  long serving = 0;
+  const int serialise = (mpi.thread_support == MPI_THREAD_SERIALIZED);
+
+  const int nsteps = 8 * opt.nchunks;
   time.setup = MPI_Wtime() - time.setup;
 
   /* Start the timer */
   double tick = MPI_Wtime();
 
-  /* Start parallel region. Locks must be set within this region for spec conformance */
 #pragma omp parallel
 {
-  /* Send requests - 2 per thread */
-  MPI_Request req[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
-
   const int thrd = omp_get_thread_num();
 
-  /* Lock all the locks, except the first */
-  if (thrd > 0 && mpi.thread_support == MPI_THREAD_SERIALIZED) {
-    omp_set_lock(lock+thrd);
-  }
+  while (1) {
 
+    int left;
+    #pragma omp atomic read
+    left = remaining;
+    if (left == 0) break;
 
-  /* Octant loops - 0 is stepping backwards, 1 is stepping forwards */
-  for (int k = 0; k < 2; k++) {
-    for (int j = 0; j < 2; j++) {
-      for (int i = 0; i < 2; i++) {
-
-        /* Loop over energy groups in parallel, setting up
-         * one concurrent sweep per group
-         */
-        #pragma omp for
-        for (int g = 0; g < opt.ng; g++) {
-
-
-          /* Loop over messages to send per octant */
-          for (int c = 0; c < opt.nchunks; c++) {
-
-            /* Receive payload from upwind neighbours */
-            double comtime = MPI_Wtime();
-
-            /* Lock if necessary before comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              omp_set_lock(lock+thrd);
-            }
-
-            if (j == 0) {
-              MPI_Recv(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.yhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            else {
-              MPI_Recv(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.ylo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-
-            if (k == 0) {
-              MPI_Recv(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            else {
-              MPI_Recv(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zlo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-
-            /* Just time last thread */
-            if (thrd == nthrds-1) {
-              time.comms += MPI_Wtime() - comtime;
-            }
-
-            /* Unlock neighbour thread if necessary after comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              int nxt = (thrd+1 == nthrds) ? 0 : thrd+1;
-              omp_unset_lock(lock+nxt);
-            }
-
-            /* Do proportional "work" */
-            for (int w = 0; w < opt.nang*opt.chunklen*opt.ny*opt.nz; w++) {
-              compute();
-            }
-
-            /* Send payload to downwind neighbours */
-            comtime = MPI_Wtime();
-
-            /* Lock if necessary before comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              omp_set_lock(lock+thrd);
-            }
-
-            MPI_Waitall(2, req, MPI_STATUS_IGNORE);
-
-            if (j == 0) {
-              MPI_Isend(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.ylo, 0, MPI_COMM_WORLD, req+0);
-            }
-            else {
-              MPI_Isend(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.yhi, 0, MPI_COMM_WORLD, req+0);
-            }
-
-            if (k == 0) {
-              MPI_Isend(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zlo, 0, MPI_COMM_WORLD, req+1);
-            }
-            else {
-              MPI_Isend(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zhi, 0, MPI_COMM_WORLD, req+1);
-            }
-
-            /* Just time last thread */
-            if (thrd == nthrds-1) {
-              time.comms += MPI_Wtime() - comtime;
-            }
-
-            /* Unlock next thread if necessary after comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              int nxt = (thrd+1 == nthrds) ? 0 : thrd+1;
-              omp_unset_lock(lock+nxt);
-            }
-
-          } /* End nchunks loop */
-        } /* End ng loop */
-      } /* End i loop */
-    } /* End j loop */
-  } /* End k loop */
-
-  /* Unset all the locks, except the first */
-  if (thrd > 0 && mpi.thread_support == MPI_THREAD_SERIALIZED) {
-    omp_unset_lock(lock+thrd);
-  }
+    /* Take a group from our own queue, or steal one from another thread */
+    int g = deque_pop_bottom(queue + thrd);
+    for (int t = 1; g < 0 && t < nthrds; t++) {
+      g = deque_steal_top(queue + (thrd+t)%nthrds);
+    }
+    if (g < 0) continue;
+
+    groupstate *gs = state + g;
+    const int o = gs->step / opt.nchunks;
+    const int c = gs->step % opt.nchunks;
+    const int oct = octant_order[opt.octants][o];
+    const int buf = gs->step % 2;
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Unless pipelining, every group finishes the octant before any start the next */
+    if (opt.octants == ORDERED_OCTANTS && c == 0 && o > 0) {
+      int done;
+      #pragma omp atomic read
+      done = octdone[o-1];
+      if (done < opt.ng) {
+        deque_push_top(queue + thrd, g);
+        continue;
+      }
+    }
+
+    /*
+     * Receive payload from upwind neighbours, into the buffer sent from
+     * two chunks ago once that send has completed. The x face arrives
+     * before the first chunk, once the last one has been sent.
+     * Messages are matched by group and octant, with a tag or a
+     * communicator for each group, as the receives of several groups
+     * may be posted at once.
+     */
+    double comtime = MPI_Wtime();
+    if (serialise) take_turn(&ticket, &serving);
+
+    if (!gs->posted) {
+      int sent;
+      MPI_Testall(2, gs->send[buf], &sent, MPI_STATUSES_IGNORE);
+      if (sent && c == 0) {
+        MPI_Test(&gs->xsend, &sent, MPI_STATUS_IGNORE);
+      }
+      if (sent) {
+        const int tag = group_tag(opt, oct, g);
+        const MPI_Comm comm = group_comm(mpi, g);
+        MPI_Irecv(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, (j == 0) ? mpi.yhi : mpi.ylo, tag, comm, gs->recv+0);
+        MPI_Irecv(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, (k == 0) ? mpi.zhi : mpi.zlo, tag, comm, gs->recv+1);
+        if (c == 0) {
+          MPI_Irecv(xbuf+g*xcount, xcount, MPI_DOUBLE, (i == 0) ? mpi.xhi : mpi.xlo, tag, comm, gs->recv+2);
+        }
+        gs->posted = 1;
+      }
+    }
+
+    int arrived = 0;
+    if (gs->posted) {
+      MPI_Testall(3, gs->recv, &arrived, MPI_STATUSES_IGNORE);
+    }
+
+    if (serialise) end_turn(&serving);
+
+    /* Just time last thread */
+    if (thrd == nthrds-1) {
+      time.comms += MPI_Wtime() - comtime;
+    }
+
+    /* Not ready yet - put it where we will come to it last */
+    if (!arrived) {
+      deque_push_top(queue + thrd, g);
+      continue;
+    }
+
+    /* Do proportional "work" */
+    compute_chunk(opt, oct, c, g, 0, 1, ybuf[buf]+g*ycount, zbuf[buf]+g*zcount, xbuf+g*xcount);
+
+    /* Send payload to downwind neighbours */
+    comtime = MPI_Wtime();
+    if (serialise) take_turn(&ticket, &serving);
+
+    const int tag = group_tag(opt, oct, g);
+    const MPI_Comm comm = group_comm(mpi, g);
+    MPI_Isend(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, (j == 0) ? mpi.ylo : mpi.yhi, tag, comm, gs->send[buf]+0);
+    MPI_Isend(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, (k == 0) ? mpi.zlo : mpi.zhi, tag, comm, gs->send[buf]+1);
+    if (c == opt.nchunks-1) {
+      MPI_Isend(xbuf+g*xcount, xcount, MPI_DOUBLE, (i == 0) ? mpi.xlo : mpi.xhi, tag, comm, &gs->xsend);
+    }
+
+    if (serialise) end_turn(&serving);
+
+    /* Just time last thread */
+    if (thrd == nthrds-1) {
+      time.comms += MPI_Wtime() - comtime;
+    }
+
+    gs->step++;
+    gs->posted = 0;
+
+    if (c == opt.nchunks-1) {
+      #pragma omp atomic update
+      octdone[o]++;
+    }
+
+    /* Carry on with the same group while it is warm in cache */
+    if (gs->step < nsteps) {
+      deque_push_bottom(queue + thrd, g);
+    }
+    else {
+      #pragma omp atomic update
+      remaining--;
+    }
+
+  } /* End work loop */
 
 } /* End parallel region */
 
+  /* Make sure the last faces have gone before the buffers are used again */
+  double comtime = MPI_Wtime();
+  for (int g = 0; g < opt.ng; g++) {
+    MPI_Waitall(4, &state[g].send[0][0], MPI_STATUSES_IGNORE);
+    MPI_Wait(&state[g].xsend, MPI_STATUS_IGNORE);
+  }
+  time.comms += MPI_Wtime() - comtime;
+
   /* End the timer */
   double tock = MPI_Wtime();
 
   time.sweeping = tock-tick;
 
-  /* Destroy lock */
-  if (mpi.thread_support == MPI_THREAD_SERIALIZED) {
-    for (int l = 0; l < nthrds; l++) {
-      omp_destroy_lock(lock+l);
-    }
+  return time;
+}
+
+/* Queue a group at the owner's end */
+void deque_push_bottom(deque *q, int g) {
+  omp_set_lock(&q->lock);
+  q->item[(q->head + q->count) % q->cap] = g;
+  q->count++;
+  omp_unset_lock(&q->lock);
+}
+
+/* Queue a group at the thieves' end */
+void deque_push_top(deque *q, int g) {
+  omp_set_lock(&q->lock);
+  q->head = (q->head + q->cap - 1) % q->cap;
+  q->item[q->head] = g;
+  q->count++;
+  omp_unset_lock(&q->lock);
+}
+
+/* Take a group from the owner's end, or -1 if empty */
+int deque_pop_bottom(deque *q) {
+  int g = -1;
+  omp_set_lock(&q->lock);
+  if (q->count > 0) {
+    q->count--;
+    g = q->item[(q->head + q->count) % q->cap];
   }
-  end_par_mpi_multi_lock_sweep(ybuf, zbuf);
+  omp_unset_lock(&q->lock);
+  return g;
+}
 
-  time.setup += MPI_Wtime() - tock;
+/* Take a group from the thieves' end, or -1 if empty */
+int deque_steal_top(deque *q) {
+  int g = -1;
+  omp_set_lock(&q->lock);
+  if (q->count > 0) {
+    g = q->item[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+  }
+  omp_unset_lock(&q->lock);
+  return g;
+}
 
-  return time;
+/* Wait for our turn to call MPI */
+void take_turn(long *ticket, long *serving) {
+  long mine;
+  #pragma omp atomic capture seq_cst
+  mine = (*ticket)++;
+
+  long now;
+  do {
+    #pragma omp atomic read seq_cst
+    now = *serving;
+  } while (now != mine);
+}
+
+/* Pass the turn to the next ticket */
+void end_turn(long *serving) {
+  #pragma omp atomic update seq_cst
+  (*serving)++;
 }
 
 /* Allocate MPI message buffers */
-void init_par_mpi_multi_lock_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf) {
-  (*ybuf) = malloc(sizeof(double)*ycount);
-  (*zbuf) = malloc(sizeof(double)*zcount);
+void init_par_mpi_multi_lock_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  *xbuf = malloc(sizeof(double)*xcount);
 }
 
 /* Free MPI message buffers */
-void end_par_mpi_multi_lock_sweep(double *ybuf, double *zbuf) {
-  free(ybuf);
-  free(zbuf);
+void end_par_mpi_multi_lock_sweep(double **ybuf, double **zbuf, double *xbuf) {
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  free(xbuf);
 }
 
+
+/*
+ * Build the message buffers - two of each so that a receive never lands
+ * in a buffer which is still being sent from, and one for the x face -
+ * a queue for each thread, and the group states, unless those from an
+ * earlier sweep are still right.
+ */
+void init_par_mpi_multi_lock_context(mpistate mpi, options opt) {
+  (void)mpi;
+  int nthrds;
+  #pragma omp parallel
+  {
+    nthrds = omp_get_num_threads();
+  }
+
+  const int ycount = opt.nang * opt.nz * opt.chunklen;
+  const int zcount = opt.nang * opt.ny * opt.chunklen;
+  const int xcount = opt.nang * opt.ny * opt.nz;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->ng == opt.ng && context->nthrds == nthrds) return;
+    end_par_mpi_multi_lock_context();
+  }
+
+  context = malloc(sizeof(multi_lock_context));
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->ng = opt.ng;
+  context->nthrds = nthrds;
+  init_par_mpi_multi_lock_sweep(opt.ng*ycount, opt.ng*zcount, opt.ng*xcount, context->ybuf, context->zbuf, &context->xbuf);
+
+  context->queue = malloc(sizeof(deque)*nthrds);
+  for (int t = 0; t < nthrds; t++) {
+    context->queue[t].item = malloc(sizeof(int)*opt.ng);
+    context->queue[t].cap = opt.ng;
+    omp_init_lock(&context->queue[t].lock);
+  }
+  context->state = malloc(sizeof(groupstate)*opt.ng);
+}
+
+/* Free the message buffers, queues and group states */
+void end_par_mpi_multi_lock_context(void) {
+  if (!context) return;
+
+  for (int t = 0; t < context->nthrds; t++) {
+    omp_destroy_lock(&context->queue[t].lock);
+    free(context->queue[t].item);
+  }
+  free(context->queue);
+  free(context->state);
+  end_par_mpi_multi_lock_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context);
+  context = NULL;
+}
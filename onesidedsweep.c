@@ -23,38 +23,77 @@
 #include <stdlib.h>
 #include "sweep.h"
 
-#include <stdio.h>
+/* Number of faces which can be in flight to each neighbour */
+#define NSLOTS 2
 
-void init_one_sided_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf, MPI_Win *ywin, MPI_Win *zwin, const int ylo, const int yhi, const int zlo, const int zhi);
-void end_one_sided_sweep(MPI_Win *ywin, MPI_Win *zwin, const int ylo, const int yhi, const int zlo, const int zhi);
+/*
+ * Neighbours in the order of mpistate, lo then hi for each dimension.
+ * From the neighbour's side this rank is on the opposite side, nbr^1.
+ */
+enum neighbour {XLO, XHI, YLO, YHI, ZLO, ZHI, NNBRS};
+
+/* Offsets of the counters in the flag window */
+#define ARRIVED 0
+#define FREED NNBRS
+
+/* Synchronisation the windows are set up for */
+enum rma_mode {PASSIVE_RMA, ACTIVE_RMA};
+
+/*
+ * Windows and sequence counters, kept between sweeps until the face
+ * sizes or synchronisation change.
+ * Each rank exposes NSLOTS landing slots for the faces from each
+ * neighbour, with a window for each dimension as the neighbours in
+ * one dimension all have the same face size.
+ * For passive target, the flag window holds the number of faces which
+ * have arrived from each neighbour, and the number of faces sent to
+ * each neighbour which it has finished with. For active target, there
+ * is a group for each neighbour instead.
+ */
+typedef struct one_sided_state {
+  int mode;
+  int chunklen, nang, ng;
+  int count[3];
+  double *face[3];
+  MPI_Win facewin[3];
+  int *flags;
+  MPI_Win flagwin;
+  MPI_Group nbrgroup[NNBRS];
+
+  /* Faces sent to, and received from, each neighbour so far */
+  int nsent[NNBRS];
+  int nrecv[NNBRS];
+} one_sided_state;
+
+static one_sided_state *state = NULL;
+
+void init_one_sided_sweep(mpistate mpi, options opt, int mode);
+double *get_face(mpistate mpi, const int *nbrs, int n);
+void put_face(mpistate mpi, const int *nbrs, int n, double *face);
+void release_face(const int *nbrs, int n);
+void wait_counter(mpistate mpi, int disp, int target);
+double *landing_slot(int n, int seq);
+void expose_face(const int *nbrs, int n);
+double *wait_face(const int *nbrs, int n);
+void put_face_active(const int *nbrs, int n, double *face);
 
 /* Perform a KBA sweep threading over groups inside the chunk
  *
  * This method uses the one-sided RMA MPI communication pattern,
- * with _passive_ synchronisation.
- * A window is created on each MPI rank.
- * Shared locks created on this window for neighbouring processors.
- * The sweep goes in all directions, and so therefore this lock is shared
- * rather than exclusive as each rank has two neighbours which may write
- * to the buffer dependent on the sweep direction.
- * Signals are used to synchronise between ranks.
- * The send protocol is therefore:
- *   1. Poll for safe signal
- *   2. MPI_Put payload + MPI_Flush
- *   3. Put done signal + MPI_Flush
- * The receive protocol is therefore:
- *   1. Put safe signal + MPI_Flush
- *   2. Poll for done signal
- *   3. Use data
+ * with _passive_ synchronisation in a single MPI_Win_lock_all epoch.
+ * Faces are put straight into landing slots in the downwind neighbour's
+ * window, and the two sides keep in step with sequence counters which
+ * only ever increase, updated with MPI_Accumulate and read atomically
+ * with MPI_Fetch_and_op.
+ * The send protocol for the nth face to a neighbour is therefore:
+ *   1. Wait until the neighbour has freed face n-NSLOTS
+ *   2. MPI_Put payload into slot n%NSLOTS + MPI_Win_flush
+ *   3. Add one to the neighbour's arrived counter + MPI_Win_flush
+ * The receive protocol for the nth face from a neighbour is therefore:
+ *   1. Wait until the arrived counter passes n
+ *   2. Use data in slot n%NSLOTS, updating it in place and sending it on
+ *   3. Add one to the neighbour's freed counter
  */
-
-#define SAFE_SIGNAL 123456789.0
-#define SENT_SIGNAL 987654321.0
-#define NULL_SIGNAL -1.0
-/* Offsets from the main array where the signals can be found */
-#define SAFE_OFFSET 0
-#define SENT_OFFSET 1
-
 timings one_sided_sweep(mpistate mpi, options opt) {
 
   timings time = {
@@ -63,341 +102,385 @@ timings one_sided_sweep(mpistate mpi, options opt) {
     .comms = 0.0
   };
 
-  /* Message buffers */
-  time.setup = MPI_Wtime();
-  const int ycount = opt.nang * opt.nz * opt.chunklen * opt.ng;
-  const int zcount = opt.nang * opt.ny * opt.chunklen * opt.ng;
-  double *ybuf;
-  double *zbuf;
-  MPI_Win ywin, zwin;
-  init_one_sided_sweep(ycount, zcount, &ybuf, &zbuf, &ywin, &zwin, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi);
-  time.setup = MPI_Wtime() - time.setup;
+  /* Windows - built before the first sweep, and kept unless the faces change size */
+  init_one_sided_context(mpi, opt);
+  const int nbrs[NNBRS] = {mpi.xlo, mpi.xhi, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi};
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Upwind neighbours - stepping backwards the faces come from the hi side */
+    const int xup = (i == 0) ? XHI : XLO;
+    const int yup = (j == 0) ? YHI : YLO;
+    const int zup = (k == 0) ? ZHI : ZLO;
+
+    /* The x face is carried through the chunks of the octant in its slot */
+    double comtime = MPI_Wtime();
+    double *xbuf = get_face(mpi, nbrs, xup);
+    time.comms += MPI_Wtime() - comtime;
+
+    /* Loop over messages to send per octant */
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      /* Receive payload from upwind neighbours */
+      comtime = MPI_Wtime();
+      double *ybuf = get_face(mpi, nbrs, yup);
+      double *zbuf = get_face(mpi, nbrs, zup);
+      time.comms += MPI_Wtime() - comtime;
 
-  char *filename = NULL;
-  asprintf(&filename, "output.%d", mpi.rank);
-  FILE *fp = fopen(filename, "w");
+      #pragma omp parallel for
+      for (int g = 0; g < opt.ng; g++) {
+
+        /* Do proportional "work" */
+        compute_chunk(opt, oct, c, g, g, opt.ng, ybuf, zbuf, xbuf);
+
+      } /* End group loop */
+
+      /* Put (send) payload in downwind neighbours window, and free the slots upwind */
+      comtime = MPI_Wtime();
+      put_face(mpi, nbrs, yup^1, ybuf);
+      put_face(mpi, nbrs, zup^1, zbuf);
+      release_face(nbrs, yup);
+      release_face(nbrs, zup);
+
+      /* The x face leaves after the last chunk */
+      if (c == opt.nchunks-1) {
+        put_face(mpi, nbrs, xup^1, xbuf);
+        release_face(nbrs, xup);
+      }
+      time.comms += MPI_Wtime() - comtime;
+
+    } /* End nchunks loop */
+  } /* End octant loop */
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/* Perform a KBA sweep threading over groups inside the chunk
+ *
+ * This method uses the same windows as one_sided_sweep, but with
+ * _active_ target synchronisation: generalised MPI_Win_post/start/
+ * complete/wait epochs, with the groups only holding the upwind or
+ * downwind neighbour in each dimension.
+ * Each face is one epoch on the window for its dimension. A rank
+ * exposes the landing slot for its next face from the upwind neighbour
+ * as soon as it has waited for the current one, so the neighbour can
+ * send ahead while this rank computes on the other slot. Sending is an
+ * access epoch of a single MPI_Put to the downwind neighbour:
+ *   1. MPI_Win_start on the downwind group
+ *   2. MPI_Put payload into slot n%NSLOTS
+ *   3. MPI_Win_complete
+ * Receiving closes the exposure epoch for the face, and opens the next:
+ *   1. MPI_Win_wait until the upwind neighbour has completed
+ *   2. MPI_Win_post on the upwind group for the next face
+ *   3. Use data in slot n%NSLOTS, updating it in place and sending it on
+ */
+timings pscw_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
 
-  /* Send requests */
-  MPI_Request req[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+  /* Windows - built before the first sweep, and kept unless the faces change size */
+  init_pscw_context(mpi, opt);
+  const int nbrs[NNBRS] = {mpi.xlo, mpi.xhi, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi};
 
   /* Start the timer */
   double tick = MPI_Wtime();
 
-  /* Octant loops - 0 is stepping backwards, 1 is stepping forwards */
-  for (int k = 0; k < 2; k++) {
-    for (int j = 0; j < 2; j++) {
-      for (int i = 0; i < 2; i++) {
-        fprintf(fp,"%d: starting oct: %d\n", mpi.rank, i+2*j+4*k);
-        fflush(fp);
-        int oct = i+2*j+4*k;
-
-        /* Loop over messages to send per octant */
-        for (int c = 0; c < opt.nchunks; c++) {
-
-          /* Receive payload from upwind neighbours */
-          double comtime = MPI_Wtime();
-          if (j == 0) {
-            /* Do comms if internal boundary */
-            if (mpi.yhi != MPI_PROC_NULL) {
-              fprintf(fp,"%d: oct %d recv from %d j=0\n", mpi.rank, oct, mpi.yhi);
-        fflush(fp);
-              /* Send safe signal */
-              ybuf[ycount+SAFE_OFFSET] = SAFE_SIGNAL+oct;
-              MPI_Put(ybuf+ycount+SAFE_OFFSET, 1, MPI_DOUBLE, mpi.yhi, ycount+SAFE_OFFSET, 1, MPI_DOUBLE, ywin);
-              MPI_Win_flush(mpi.yhi, ywin);
-
-              /* Poll for sent signal - lock required around access */
-              int sent = 0;
-              while (!sent) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, ywin);
-                if (ybuf[ycount+SENT_OFFSET] == SENT_SIGNAL+oct)
-                  sent = 1;
-                MPI_Win_unlock(mpi.rank, ywin);
-              }
-
-              /* Reset signal */
-              ybuf[ycount+SENT_OFFSET] = NULL_SIGNAL;
-              MPI_Win_flush(mpi.rank, ywin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          else {
-            /* Do comms if internal boundary */
-            if (mpi.ylo != MPI_PROC_NULL) {
-              fprintf(fp,"%d: oct %d recv from %d j/=0\n", mpi.rank, oct, mpi.ylo);
-        fflush(fp);
-              /* Send safe signal */
-              ybuf[ycount+SAFE_OFFSET] = SAFE_SIGNAL+oct;
-              MPI_Put(ybuf+ycount+SAFE_OFFSET, 1, MPI_DOUBLE, mpi.ylo, ycount+SAFE_OFFSET, 1, MPI_DOUBLE, ywin);
-              MPI_Win_flush(mpi.ylo, ywin);
-
-              /* Poll for sent signal - lock required around access */
-              int sent = 0;
-              while (!sent) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, ywin);
-                if (ybuf[ycount+SENT_OFFSET] == SENT_SIGNAL+oct)
-                  sent = 1;
-                MPI_Win_unlock(mpi.rank, ywin);
-              }
-
-              /* Reset signal */
-              ybuf[ycount+SENT_OFFSET] = NULL_SIGNAL;
-              MPI_Win_flush(mpi.rank, ywin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          if (k == 0) {
-            /* Do comms if internal boundary */
-            if (mpi.zhi != MPI_PROC_NULL) {
-              fprintf(fp,"%d: oct %d recv from %d k=0\n", mpi.rank, oct, mpi.zhi);
-        fflush(fp);
-              /* Send safe signal */
-              zbuf[zcount+SAFE_OFFSET] = SAFE_SIGNAL+oct;
-              MPI_Put(zbuf+zcount+SAFE_OFFSET, 1, MPI_DOUBLE, mpi.zhi, zcount+SAFE_OFFSET, 1, MPI_DOUBLE, zwin);
-              MPI_Win_flush(mpi.zhi, zwin);
-
-              /* Poll for sent signal - lock required around access */
-              int sent = 0;
-              while (!sent) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, zwin);
-                if (zbuf[zcount+SENT_OFFSET] == SENT_SIGNAL+oct)
-                  sent = 1;
-                MPI_Win_unlock(mpi.rank, zwin);
-              }
-
-              /* Reset signal */
-              zbuf[zcount+SENT_OFFSET] = NULL_SIGNAL;
-              MPI_Win_flush(mpi.rank, zwin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          else {
-            /* Do comms if internal boundary */
-            if (mpi.zlo != MPI_PROC_NULL) {
-              fprintf(fp,"%d: oct %d recv from %d k/=0\n", mpi.rank, oct, mpi.zlo);
-        fflush(fp);
-              /* Send safe signal */
-              zbuf[zcount+SAFE_OFFSET] = SAFE_SIGNAL+oct;
-              MPI_Put(zbuf+zcount+SAFE_OFFSET, 1, MPI_DOUBLE, mpi.zlo, zcount+SAFE_OFFSET, 1, MPI_DOUBLE, zwin);
-              MPI_Win_flush(mpi.zlo, zwin);
-
-              /* Poll for sent signal - lock required around access */
-              int sent = 0;
-              while (!sent) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, zwin);
-                if (zbuf[zcount+SENT_OFFSET] == SENT_SIGNAL+oct)
-                  sent = 1;
-                MPI_Win_unlock(mpi.rank, zwin);
-              }
-
-              /* Reset signal */
-              zbuf[zcount+SENT_OFFSET] = NULL_SIGNAL;
-              MPI_Win_flush(mpi.rank, zwin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          time.comms += MPI_Wtime() - comtime;
-
-
-          /*********************************************************************
-          * Compute
-          *********************************************************************/
-          fprintf(fp,"%d: compute oct %d\n", mpi.rank, i+2*j+4*k);
-        fflush(fp);
-          #pragma omp parallel for
-          for (int g = 0; g < opt.ng; g++) {
-
-            /* Do proportional "work" */
-            for (int w = 0; w < opt.nang*opt.chunklen*opt.ny*opt.nz; w++) {
-              compute();
-            }
-
-          } /* End group loop */
-
-          /*********************************************************************
-          * End compute
-          *********************************************************************/
-
-
-          /* Put (send) payload in downwind neighbours window */
-          comtime = MPI_Wtime();
-
-          if (j == 0) {
-            /* Do comms if internal boundary */
-            if (mpi.ylo != MPI_PROC_NULL) {
-              /* Poll for safe to send signal - lock required around access */
-              fprintf(fp,"%d: oct %d send to %d j=0\n", mpi.rank, oct, mpi.ylo);
-        fflush(fp);
-              int safe = 0;
-              while (!safe) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, ywin);
-                if (ybuf[ycount+SAFE_OFFSET] == SAFE_SIGNAL+oct)
-                  safe = 1;
-                MPI_Win_unlock(mpi.rank, ywin);
-              }
-
-              /* Reset signal */
-              ybuf[ycount+SAFE_OFFSET] = NULL_SIGNAL;
-
-              /* Put payload */
-              MPI_Put(ybuf, ycount, MPI_DOUBLE, mpi.ylo, 0, ycount, MPI_DOUBLE, ywin);
-              MPI_Win_flush(mpi.ylo, ywin);
-
-              /* Send sent signal */
-              ybuf[ycount+SENT_OFFSET] = SENT_SIGNAL+oct;
-              MPI_Put(ybuf+ycount+SENT_OFFSET, 1, MPI_DOUBLE, mpi.ylo, ycount+SENT_OFFSET, 1, MPI_DOUBLE, ywin);
-              MPI_Win_flush(mpi.ylo, ywin);
-              MPI_Win_flush(mpi.rank, ywin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          else {
-            /* Do comms if internal boundary */
-            if (mpi.yhi != MPI_PROC_NULL) {
-              fprintf(fp,"%d: oct %d send to %d j/=0\n", mpi.rank, oct, mpi.yhi);
-        fflush(fp);
-              /* Poll for safe to send signal - lock required around access */
-              int safe = 0;
-              while (!safe) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, ywin);
-                if (ybuf[ycount+SAFE_OFFSET] == SAFE_SIGNAL+oct)
-                  safe = 1;
-                MPI_Win_unlock(mpi.rank, ywin);
-              }
-
-              /* Reset signal */
-              ybuf[ycount+SAFE_OFFSET] = NULL_SIGNAL;
-
-              /* Put payload */
-              MPI_Put(ybuf, ycount, MPI_DOUBLE, mpi.yhi, 0, ycount, MPI_DOUBLE, ywin);
-              MPI_Win_flush(mpi.yhi, ywin);
-
-              /* Send sent signal */
-              ybuf[ycount+SENT_OFFSET] = SENT_SIGNAL+oct;
-              MPI_Put(ybuf+ycount+SENT_OFFSET, 1, MPI_DOUBLE, mpi.yhi, ycount+SENT_OFFSET, 1, MPI_DOUBLE, ywin);
-              MPI_Win_flush(mpi.yhi, ywin);
-              MPI_Win_flush(mpi.rank, ywin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          if (k == 0) {
-            /* Do comms if internal boundary */
-            if (mpi.zlo != MPI_PROC_NULL) {
-              fprintf(fp,"%d: oct %d send to %d k=0\n", mpi.rank, oct, mpi.zlo);
-        fflush(fp);
-              /* Poll for safe to send signal - lock required around access */
-              int safe = 0;
-              while (!safe) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, zwin);
-                if (zbuf[zcount+SAFE_OFFSET] == SAFE_SIGNAL+oct)
-                  safe = 1;
-                MPI_Win_unlock(mpi.rank, zwin);
-              }
-
-              /* Reset signal */
-              zbuf[zcount+SAFE_OFFSET] = NULL_SIGNAL;
-
-              /* Put payload */
-              MPI_Put(zbuf, zcount, MPI_DOUBLE, mpi.zlo, 0, zcount, MPI_DOUBLE, zwin);
-              MPI_Win_flush(mpi.zlo, zwin);
-
-              /* Send sent signal */
-              zbuf[zcount+SENT_OFFSET] = SENT_SIGNAL+oct;
-              MPI_Put(zbuf+zcount+SENT_OFFSET, 1, MPI_DOUBLE, mpi.zlo, zcount+SENT_OFFSET, 1, MPI_DOUBLE, zwin);
-              MPI_Win_flush(mpi.zlo, zwin);
-              MPI_Win_flush(mpi.rank, zwin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          else {
-            /* Do comms if internal boundary */
-            if (mpi.zhi != MPI_PROC_NULL) {
-              fprintf(fp,"%d: oct %d, send to %d k/=0\n", mpi.rank, oct, mpi.zhi);
-        fflush(fp);
-              /* Poll for safe to send signal - lock required around access */
-              int safe = 0;
-              while (!safe) {
-                MPI_Win_lock(MPI_LOCK_SHARED, mpi.rank, 0, zwin);
-                if (zbuf[zcount+SAFE_OFFSET] == SAFE_SIGNAL+oct)
-                  safe = 1;
-                MPI_Win_unlock(mpi.rank, zwin);
-              }
-
-              /* Reset signal */
-              zbuf[zcount+SAFE_OFFSET] = NULL_SIGNAL;
-
-              /* Put payload */
-              MPI_Put(zbuf, zcount, MPI_DOUBLE, mpi.zhi, 0, zcount, MPI_DOUBLE, zwin);
-              MPI_Win_flush(mpi.zhi, zwin);
-
-              /* Send sent signal */
-              zbuf[zcount+SENT_OFFSET] = SENT_SIGNAL+oct;
-              MPI_Put(zbuf+zcount+SENT_OFFSET, 1, MPI_DOUBLE, mpi.zhi, zcount+SENT_OFFSET, 1, MPI_DOUBLE, zwin);
-              MPI_Win_flush(mpi.zhi, zwin);
-              MPI_Win_flush(mpi.rank, zwin);
-            }
-            else {fprintf(fp, "%d, nop\n", mpi.rank); fflush(fp);}
-          }
-          time.comms += MPI_Wtime() - comtime;
-
-        } /* End nchunks loop */
-
-        //MPI_Barrier(MPI_COMM_WORLD);
-        fprintf(fp,"%d: done oct %d\n", mpi.rank, i+2*j+4*k);
-        fflush(fp);
-      } /* End i loop */
-    } /* End j loop */
-  } /* End k loop */
-
-  fprintf(fp,"%d: done!\n", mpi.rank);
-        fflush(fp);
-  fclose(fp);
+  /* Expose the slots for the first faces */
+  double comtime = MPI_Wtime();
+  {
+    const int oct = octant_order[opt.octants][0];
+    expose_face(nbrs, ((oct & 1) == 0) ? XHI : XLO);
+    expose_face(nbrs, (((oct >> 1) & 1) == 0) ? YHI : YLO);
+    expose_face(nbrs, (((oct >> 2) & 1) == 0) ? ZHI : ZLO);
+  }
+  time.comms += MPI_Wtime() - comtime;
+
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Upwind neighbours - stepping backwards the faces come from the hi side */
+    const int xup = (i == 0) ? XHI : XLO;
+    const int yup = (j == 0) ? YHI : YLO;
+    const int zup = (k == 0) ? ZHI : ZLO;
+
+    /* Upwind neighbours for the next octant */
+    const int next = (o < 7) ? octant_order[opt.octants][o+1] : oct;
+    const int nextyup = (((next >> 1) & 1) == 0) ? YHI : YLO;
+    const int nextzup = (((next >> 2) & 1) == 0) ? ZHI : ZLO;
+
+    /* The x face is carried through the chunks of the octant in its slot */
+    comtime = MPI_Wtime();
+    double *xbuf = wait_face(nbrs, xup);
+    if (o < 7) {
+      expose_face(nbrs, ((next & 1) == 0) ? XHI : XLO);
+    }
+    time.comms += MPI_Wtime() - comtime;
+
+    /* Loop over messages to send per octant */
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      /* Receive payload from upwind neighbours, and expose the slots for the next chunk */
+      comtime = MPI_Wtime();
+      double *ybuf = wait_face(nbrs, yup);
+      double *zbuf = wait_face(nbrs, zup);
+      if (c < opt.nchunks-1) {
+        expose_face(nbrs, yup);
+        expose_face(nbrs, zup);
+      }
+      else if (o < 7) {
+        expose_face(nbrs, nextyup);
+        expose_face(nbrs, nextzup);
+      }
+      time.comms += MPI_Wtime() - comtime;
+
+      #pragma omp parallel for
+      for (int g = 0; g < opt.ng; g++) {
+
+        /* Do proportional "work" */
+        compute_chunk(opt, oct, c, g, g, opt.ng, ybuf, zbuf, xbuf);
+
+      } /* End group loop */
+
+      /* Put (send) payload in downwind neighbours window */
+      comtime = MPI_Wtime();
+      put_face_active(nbrs, yup^1, ybuf);
+      put_face_active(nbrs, zup^1, zbuf);
+
+      /* The x face leaves after the last chunk */
+      if (c == opt.nchunks-1) {
+        put_face_active(nbrs, xup^1, xbuf);
+      }
+      time.comms += MPI_Wtime() - comtime;
+
+    } /* End nchunks loop */
+  } /* End octant loop */
 
   /* End the timer */
   double tock = MPI_Wtime();
 
   time.sweeping = tock-tick;
 
-  end_one_sided_sweep(&ywin, &zwin, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi);
+  return time;
+}
 
-  time.setup += MPI_Wtime() - tock;
+/*
+ * Wait for the next face from neighbour n, and return its slot.
+ * On the edge of the domain there is no neighbour, and the slot is
+ * only used to hold the outgoing face.
+ */
+double *get_face(mpistate mpi, const int *nbrs, int n) {
+  const int dim = n / 2;
+  const int seq = state->nrecv[n]++;
+  if (nbrs[n] != MPI_PROC_NULL) {
+    wait_counter(mpi, ARRIVED + n, seq + 1);
+    MPI_Win_sync(state->facewin[dim]);
+  }
+  return landing_slot(n, seq);
+}
 
-  return time;
+/* Slot on this rank for face seq from neighbour n */
+double *landing_slot(int n, int seq) {
+  const int dim = n / 2;
+  return state->face[dim] + ((n%2)*NSLOTS + seq%NSLOTS) * state->count[dim];
+}
+
+/* Put a face into the next slot for this rank in neighbour n's window, once that slot is free */
+void put_face(mpistate mpi, const int *nbrs, int n, double *face) {
+  if (nbrs[n] == MPI_PROC_NULL) return;
+
+  const int dim = n / 2;
+  const int seq = state->nsent[n]++;
+  wait_counter(mpi, FREED + n, seq - NSLOTS + 1);
+
+  /* This rank is on the opposite side of the neighbour */
+  const MPI_Aint disp = (MPI_Aint)(((n^1)%2)*NSLOTS + seq%NSLOTS) * state->count[dim];
+  MPI_Put(face, state->count[dim], MPI_DOUBLE, nbrs[n], disp, state->count[dim], MPI_DOUBLE, state->facewin[dim]);
+  MPI_Win_flush(nbrs[n], state->facewin[dim]);
+
+  const int one = 1;
+  MPI_Accumulate(&one, 1, MPI_INT, nbrs[n], ARRIVED + (n^1), 1, MPI_INT, MPI_SUM, state->flagwin);
+  MPI_Win_flush(nbrs[n], state->flagwin);
+}
+
+/* Tell neighbour n that this rank has finished with the last face it sent */
+void release_face(const int *nbrs, int n) {
+  if (nbrs[n] == MPI_PROC_NULL) return;
+
+  const int one = 1;
+  MPI_Accumulate(&one, 1, MPI_INT, nbrs[n], FREED + (n^1), 1, MPI_INT, MPI_SUM, state->flagwin);
+  MPI_Win_flush(nbrs[n], state->flagwin);
+}
+
+/* Start the exposure epoch for the next face from neighbour n */
+void expose_face(const int *nbrs, int n) {
+  if (nbrs[n] == MPI_PROC_NULL) return;
+  MPI_Win_post(state->nbrgroup[n], 0, state->facewin[n/2]);
+}
+
+/*
+ * End the exposure epoch for the next face from neighbour n, and return its slot.
+ * On the edge of the domain there is no epoch, and the slot is only used to
+ * hold the outgoing face.
+ */
+double *wait_face(const int *nbrs, int n) {
+  const int seq = state->nrecv[n]++;
+  if (nbrs[n] != MPI_PROC_NULL) {
+    MPI_Win_wait(state->facewin[n/2]);
+  }
+  return landing_slot(n, seq);
+}
+
+/* Put a face into the next slot for this rank in neighbour n's window, in an access epoch of its own */
+void put_face_active(const int *nbrs, int n, double *face) {
+  if (nbrs[n] == MPI_PROC_NULL) return;
+
+  const int dim = n / 2;
+  const int seq = state->nsent[n]++;
+  const MPI_Aint disp = (MPI_Aint)(((n^1)%2)*NSLOTS + seq%NSLOTS) * state->count[dim];
+  MPI_Win_start(state->nbrgroup[n], 0, state->facewin[dim]);
+  MPI_Put(face, state->count[dim], MPI_DOUBLE, nbrs[n], disp, state->count[dim], MPI_DOUBLE, state->facewin[dim]);
+  MPI_Win_complete(state->facewin[dim]);
+}
+
+/* Spin on one of this rank's counters until it reaches target, reading it atomically */
+void wait_counter(mpistate mpi, int disp, int target) {
+  int value;
+  do {
+    MPI_Fetch_and_op(NULL, &value, MPI_INT, mpi.rank, disp, MPI_NO_OP, state->flagwin);
+    MPI_Win_flush(mpi.rank, state->flagwin);
+  } while (value < target);
 }
 
-/* Init MPI buffers and set up one-sided comms */
-void init_one_sided_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf, MPI_Win *ywin, MPI_Win *zwin, const int ylo, const int yhi, const int zlo, const int zhi) {
-  /* Allocate MPI window buffer*/
+/*
+ * Allocate the windows, and for passive target start the epoch, unless
+ * those from an earlier sweep are the right size and mode. Collective
+ * over all ranks, which all decide alike as the sizes only depend on
+ * the global options.
+ */
+void init_one_sided_sweep(mpistate mpi, options opt, int mode) {
+  const int count[3] = {
+    opt.nang * opt.ny * opt.nz * opt.ng,
+    opt.nang * opt.nz * opt.chunklen * opt.ng,
+    opt.nang * opt.ny * opt.chunklen * opt.ng
+  };
+  if (state) {
+    if (state->mode == mode && state->chunklen == opt.chunklen && state->nang == opt.nang && state->ng == opt.ng) return;
+    end_one_sided_sweep();
+  }
+
+  state = malloc(sizeof(one_sided_state));
+  state->mode = mode;
+  state->chunklen = opt.chunklen;
+  state->nang = opt.nang;
+  state->ng = opt.ng;
+
   MPI_Info info;
   MPI_Info_create(&info);
   MPI_Info_set(info, "same_disp_unit", "true");
-  /* Size of payload plus 2 values to allow for safe and done signals */
-  MPI_Win_allocate(sizeof(double)*(ycount+2), sizeof(double), info, MPI_COMM_WORLD, ybuf, ywin);
-  MPI_Win_allocate(sizeof(double)*(zcount+2), sizeof(double), info, MPI_COMM_WORLD, zbuf, zwin);
-
-  /* Start passive communication epoch - expose this rank's windows to its 4 neighbours */
-  MPI_Win_lock(MPI_LOCK_SHARED, ylo, 0, *ywin);
-  MPI_Win_lock(MPI_LOCK_SHARED, yhi, 0, *ywin);
-  MPI_Win_lock(MPI_LOCK_SHARED, zlo, 0, *zwin);
-  MPI_Win_lock(MPI_LOCK_SHARED, zhi, 0, *zwin);
-
-  /* Reset the signal */
-  (*ybuf)[ycount+SAFE_OFFSET] = NULL_SIGNAL;
-  (*ybuf)[ycount+SENT_OFFSET] = NULL_SIGNAL;
-  (*zbuf)[ycount+SAFE_OFFSET] = NULL_SIGNAL;
-  (*zbuf)[ycount+SENT_OFFSET] = NULL_SIGNAL;
+
+  /* NSLOTS faces from each side of each dimension */
+  for (int d = 0; d < 3; d++) {
+    state->count[d] = count[d];
+    MPI_Win_allocate(sizeof(double)*2*NSLOTS*count[d], sizeof(double), info, mpi.comm, &state->face[d], &state->facewin[d]);
+  }
+  for (int n = 0; n < NNBRS; n++) {
+    state->nsent[n] = 0;
+    state->nrecv[n] = 0;
+  }
+
+  /* Active target only needs a group for each neighbour */
+  const int nbrs[NNBRS] = {mpi.xlo, mpi.xhi, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi};
+  if (mode == ACTIVE_RMA) {
+    MPI_Info_free(&info);
+    MPI_Group commgroup;
+    MPI_Comm_group(mpi.comm, &commgroup);
+    for (int n = 0; n < NNBRS; n++) {
+      if (nbrs[n] == MPI_PROC_NULL) state->nbrgroup[n] = MPI_GROUP_NULL;
+      else MPI_Group_incl(commgroup, 1, &nbrs[n], &state->nbrgroup[n]);
+    }
+    MPI_Group_free(&commgroup);
+    return;
+  }
+
+  /* Arrived and freed counters for each neighbour */
+  MPI_Info_set(info, "accumulate_ops", "same_op_no_op");
+  MPI_Win_allocate(sizeof(int)*2*NNBRS, sizeof(int), info, mpi.comm, &state->flags, &state->flagwin);
+  MPI_Info_free(&info);
+  for (int n = 0; n < NNBRS; n++) {
+    state->flags[ARRIVED + n] = 0;
+    state->flags[FREED + n] = 0;
+  }
+
+  /* Start passive communication epoch - one for the lifetime of the windows */
+  for (int d = 0; d < 3; d++) {
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, state->facewin[d]);
+  }
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, state->flagwin);
+  MPI_Win_sync(state->flagwin);
+
+  /* Every counter must be reset before any neighbour updates it */
+  MPI_Barrier(mpi.comm);
+}
+
+/* Build the windows for the passive target sweeper */
+void init_one_sided_context(mpistate mpi, options opt) {
+  init_one_sided_sweep(mpi, opt, PASSIVE_RMA);
 }
 
-/* Finish up any MPI things */
-void end_one_sided_sweep(MPI_Win *ywin, MPI_Win *zwin, const int ylo, const int yhi, const int zlo, const int zhi) {
-  /* End passive communication epoch */
-  MPI_Win_unlock(ylo, *ywin);
-  MPI_Win_unlock(yhi, *ywin);
-  MPI_Win_unlock(zlo, *zwin);
-  MPI_Win_unlock(zhi, *zwin);
-
-  /* Free MPI message buffers */
-  MPI_Win_free(ywin);
-  MPI_Win_free(zwin);
+/* Build the windows and neighbour groups for the active target sweeper */
+void init_pscw_context(mpistate mpi, options opt) {
+  init_one_sided_sweep(mpi, opt, ACTIVE_RMA);
 }
 
+/* End the passive epoch and free the windows, or the groups for active target */
+void end_one_sided_sweep(void) {
+  if (!state) return;
+
+  if (state->mode == ACTIVE_RMA) {
+    for (int d = 0; d < 3; d++) {
+      MPI_Win_free(&state->facewin[d]);
+    }
+    for (int n = 0; n < NNBRS; n++) {
+      if (state->nbrgroup[n] != MPI_GROUP_NULL) MPI_Group_free(&state->nbrgroup[n]);
+    }
+    free(state);
+    state = NULL;
+    return;
+  }
+
+  for (int d = 0; d < 3; d++) {
+    MPI_Win_unlock_all(state->facewin[d]);
+    MPI_Win_free(&state->facewin[d]);
+  }
+  MPI_Win_unlock_all(state->flagwin);
+  MPI_Win_free(&state->flagwin);
+  free(state);
+  state = NULL;
+}
@@ -37,6 +37,12 @@ typedef struct options {
   int ny;
   int nz;
 
+  /* Ranks in x-dimension for a 3D decomposition - 1 for YZ only */
+  int npex;
+
+  /* Placement of ranks in the decomposition */
+  int placement;
+
   /* Global mesh size for strong scaling */
   int gny;
   int gnz;
@@ -44,6 +50,9 @@ typedef struct options {
   /* Angles per cell */
   int nang;
 
+  /* Angle sets each octant's angles are split into, pipelined as separate stages */
+  int angle_sets;
+
   /* Energy groups */
   int ng;
 
@@ -53,5 +62,44 @@ typedef struct options {
   /* Strong scaling run? */
   int strong;
 
+  /* Octant ordering */
+  int octants;
+
+  /* Depth of the ring of pre-posted receives for the prepost sweeper */
+  int nbufs;
+
+  /* Groups sent in each message by the bundled sweeper - 0 to choose from the performance model */
+  int groups_per_msg;
+
+  /* Front priority rule for the multi-corner sweeper */
+  int priority;
+
+  /* Work performed per cell */
+  int kernel;
+
+  /* Amount of work per angle per cell for the synthetic kernels */
+  int work;
+
+  /* Working set per thread in KiB for the memory kernels - 0 for default */
+  int wset;
+
+  /* Storage order of the angular flux and multi-group faces */
+  int layout;
+
+  /* Reuse persistent requests for the messages */
+  int persistent;
+
+  /* How the messages of concurrent group sweeps are matched */
+  int match;
+
+  /* Precision of the y and z faces on the wire */
+  int precision;
+
+  /* Where the y and z faces are kept, and how they are packed into messages */
+  int pack;
+
+  /* Search for the fastest nchunks and chunklen before the timed sweeps */
+  int autotune;
+
 }  options;
 
@@ -0,0 +1,147 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <mpi.h>
+#include "options.h"
+#include "pack.h"
+#include <stdlib.h>
+#include "transport.h"
+#include "wire.h"
+
+void face_vector(options opt, int dim, int *nblocks, int *blocklen, int *stride);
+
+/* Datatypes selecting the faces from their flux arrays */
+static MPI_Datatype ytype = MPI_DATATYPE_NULL;
+static MPI_Datatype ztype = MPI_DATATYPE_NULL;
+
+/*
+ * A face is nblocks blocks of blocklen doubles, each stride apart in its
+ * flux array. Contiguous faces are a single run of blocks.
+ */
+void face_vector(options opt, int dim, int *nblocks, int *blocklen, int *stride) {
+  if (dim == Y_FACE) {
+    *nblocks = (opt.layout == ANGLE_LAYOUT) ? opt.ng * opt.nz : opt.nz;
+    *blocklen = (opt.layout == ANGLE_LAYOUT) ? opt.chunklen * opt.nang : opt.chunklen * opt.ng * opt.nang;
+  }
+  else {
+    *nblocks = (opt.layout == ANGLE_LAYOUT) ? opt.ng : 1;
+    *blocklen = (opt.layout == ANGLE_LAYOUT) ? opt.ny * opt.chunklen * opt.nang : opt.ny * opt.chunklen * opt.ng * opt.nang;
+  }
+  *stride = *blocklen * face_planes(opt, dim);
+}
+
+int same_faces(options a, options b) {
+  return a.nang == b.nang && a.ng == b.ng && a.ny == b.ny && a.nz == b.nz && a.chunklen == b.chunklen
+    && a.layout == b.layout && a.pack == b.pack && a.precision == b.precision;
+}
+
+int face_planes(options opt, int dim) {
+  if (opt.pack == CONTIGUOUS_PACK) return 1;
+  return (dim == Y_FACE) ? opt.ny : opt.nz;
+}
+
+long face_array_count(options opt, int dim) {
+  int nblocks, blocklen, stride;
+  face_vector(opt, dim, &nblocks, &blocklen, &stride);
+  return (long)nblocks * stride;
+}
+
+void init_face_types(options opt) {
+  if (opt.pack != DATATYPE_PACK) return;
+  int nblocks, blocklen, stride;
+  face_vector(opt, Y_FACE, &nblocks, &blocklen, &stride);
+  MPI_Type_vector(nblocks, blocklen, stride, MPI_DOUBLE, &ytype);
+  MPI_Type_commit(&ytype);
+  face_vector(opt, Z_FACE, &nblocks, &blocklen, &stride);
+  MPI_Type_vector(nblocks, blocklen, stride, MPI_DOUBLE, &ztype);
+  MPI_Type_commit(&ztype);
+}
+
+void end_face_types(options opt) {
+  if (opt.pack != DATATYPE_PACK) return;
+  MPI_Type_free(&ytype);
+  MPI_Type_free(&ztype);
+}
+
+void *init_face_msg(options opt, int dim, double *array) {
+  if (opt.pack == DATATYPE_PACK) return array;
+  if (opt.pack == MANUAL_PACK) return malloc(sizeof(double)*face_msg_count(opt, dim));
+  return init_wire(opt, array, face_array_count(opt, dim));
+}
+
+void end_face_msg(options opt, void *msg) {
+  if (opt.pack == MANUAL_PACK) free(msg);
+  else if (opt.pack == CONTIGUOUS_PACK) end_wire(opt, msg);
+}
+
+int face_msg_count(options opt, int dim) {
+  if (opt.pack == DATATYPE_PACK) return 1;
+  int nblocks, blocklen, stride;
+  face_vector(opt, dim, &nblocks, &blocklen, &stride);
+  return nblocks * blocklen;
+}
+
+MPI_Datatype face_msg_type(options opt, int dim) {
+  if (opt.pack == DATATYPE_PACK) return (dim == Y_FACE) ? ytype : ztype;
+  if (opt.pack == MANUAL_PACK) return MPI_DOUBLE;
+  return wire_type(opt);
+}
+
+double face_msg_bytes(options opt, int dim) {
+  int nblocks, blocklen, stride;
+  face_vector(opt, dim, &nblocks, &blocklen, &stride);
+  return (double)nblocks * blocklen * wire_bytes(opt);
+}
+
+void pack_face(options opt, int dim, const double *array, void *msg) {
+  if (opt.pack == CONTIGUOUS_PACK) {
+    pack_wire(opt, array, msg, face_msg_count(opt, dim));
+  }
+  else if (opt.pack == MANUAL_PACK) {
+    int nblocks, blocklen, stride;
+    face_vector(opt, dim, &nblocks, &blocklen, &stride);
+    double * restrict m = msg;
+    for (int b = 0; b < nblocks; b++) {
+      const double * restrict src = array + (long)b*stride;
+      double * restrict dst = m + (long)b*blocklen;
+      #pragma omp simd
+      for (int n = 0; n < blocklen; n++) {
+        dst[n] = src[n];
+      }
+    }
+  }
+}
+
+void unpack_face(options opt, int dim, const void *msg, double *array) {
+  if (opt.pack == CONTIGUOUS_PACK) {
+    unpack_wire(opt, msg, array, face_msg_count(opt, dim));
+  }
+  else if (opt.pack == MANUAL_PACK) {
+    int nblocks, blocklen, stride;
+    face_vector(opt, dim, &nblocks, &blocklen, &stride);
+    const double * restrict m = msg;
+    for (int b = 0; b < nblocks; b++) {
+      const double * restrict src = m + (long)b*blocklen;
+      double * restrict dst = array + (long)b*stride;
+      #pragma omp simd
+      for (int n = 0; n < blocklen; n++) {
+        dst[n] = src[n];
+      }
+    }
+  }
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Packing the faces into messages
+ * The faces can be kept in their own contiguous buffers, or as a plane of
+ * a flux array over the chunk, as in a code which keeps its cell data in
+ * 3D arrays. The flux array is stored [g][z][y][x][a] in the angle layout
+ * and [z][y][x][g][a] in the group layout, with the y face in the plane
+ * y = 0 of one array and the z face in the plane z = 0 of another.
+ * A plane is then sent either with an MPI derived datatype, or gathered
+ * into a contiguous message by hand.
+ * The flux arrays only give the faces those strides; they are not the
+ * angular flux held by the transport kernel.
+ */
+
+#pragma once
+
+#include <mpi.h>
+#include "options.h"
+
+/* Where faces are kept and how they are packed into messages */
+enum pack {DATATYPE_PACK, MANUAL_PACK, CONTIGUOUS_PACK};
+
+/* Face of a chunk, as passed to the functions below */
+enum facedim {Y_FACE, Z_FACE};
+
+/* Whether two sets of options give the same face buffers and messages */
+int same_faces(options a, options b);
+
+/* Planes of the flux array a face of the chunk is spread over - 1 when contiguous */
+int face_planes(options opt, int dim);
+
+/* Doubles in the buffer holding a face for all groups, with its flux array */
+long face_array_count(options opt, int dim);
+
+/* Build, or free, the derived datatypes for --pack datatype */
+void init_face_types(options opt);
+void end_face_types(options opt);
+
+/*
+ * Message a face buffer is sent and received through. This is the face
+ * buffer itself when it needs no packing: with --pack datatype, or when
+ * contiguous at full precision. Contiguous faces are packed to the
+ * precision selected with --precision.
+ */
+void *init_face_msg(options opt, int dim, double *array);
+void end_face_msg(options opt, void *msg);
+
+/* Count and datatype to send or receive a face message with */
+int face_msg_count(options opt, int dim);
+MPI_Datatype face_msg_type(options opt, int dim);
+
+/* Bytes of a face message */
+double face_msg_bytes(options opt, int dim);
+
+/* Gather a face into its message, or scatter it back */
+void pack_face(options opt, int dim, const double *array, void *msg);
+void unpack_face(options opt, int dim, const void *msg, double *array);
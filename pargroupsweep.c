@@ -21,10 +21,26 @@
 #include <mpi.h>
 #include "options.h"
 #include <stdlib.h>
+#include "pack.h"
 #include "sweep.h"
 
-void init_par_group_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf);
-void end_par_group_sweep(double *ybuf, double *zbuf);
+void init_par_group_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_par_group_sweep(double **ybuf, double **zbuf, double *xbuf);
+
+/*
+ * Face buffers and the messages they travel in, kept between sweeps
+ * until the options they were built for change the faces
+ */
+typedef struct par_group_context {
+  options opt;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf;
+  void *ymsg[2];
+  void *zmsg[2];
+} par_group_context;
+
+static par_group_context *context = NULL;
 
 /* Perform a KBA sweep threading over groups inside the chunk */
 timings par_group_sweep(mpistate mpi, options opt) {
@@ -35,101 +51,180 @@ timings par_group_sweep(mpistate mpi, options opt) {
     .comms = 0.0
   };
 
-  /* Message buffers */
-  time.setup = MPI_Wtime();
-  const int ycount = opt.nang * opt.nz * opt.chunklen * opt.ng;
-  const int zcount = opt.nang * opt.ny * opt.chunklen * opt.ng;
-  double *ybuf;
-  double *zbuf;
-  init_par_group_sweep(ycount, zcount, &ybuf, &zbuf);
-  time.setup = MPI_Wtime() - time.setup;
-
-  /* Send requests */
-  MPI_Request req[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+  /* Face buffers and messages, built before the first sweep */
+  init_par_group_context(mpi, opt);
+  const int xcount = opt.nang * opt.ny * opt.nz * opt.ng;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double *xbuf = context->xbuf;
+  void **ymsg = context->ymsg;
+  void **zmsg = context->zmsg;
+  const int ycount = face_msg_count(opt, Y_FACE);
+  const int zcount = face_msg_count(opt, Z_FACE);
+  const MPI_Datatype ytype = face_msg_type(opt, Y_FACE);
+  const MPI_Datatype ztype = face_msg_type(opt, Z_FACE);
+  int buf = 0;
+
+  /* Send requests - y, z and x */
+  MPI_Request req[3] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL, MPI_REQUEST_NULL};
 
   /* Start the timer */
   double tick = MPI_Wtime();
 
-  /* Octant loops - 0 is stepping backwards, 1 is stepping forwards */
-  for (int k = 0; k < 2; k++) {
-    for (int j = 0; j < 2; j++) {
-      for (int i = 0; i < 2; i++) {
-
-        /* Loop over messages to send per octant */
-        for (int c = 0; c < opt.nchunks; c++) {
-
-          /* Receive payload from upwind neighbours */
-          double comtime = MPI_Wtime();
-          if (j == 0) {
-            MPI_Recv(ybuf, ycount, MPI_DOUBLE, mpi.yhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-          }
-          else {
-            MPI_Recv(ybuf, ycount, MPI_DOUBLE, mpi.ylo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-          }
-
-          if (k == 0) {
-            MPI_Recv(zbuf, zcount, MPI_DOUBLE, mpi.zhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-          }
-          else {
-            MPI_Recv(zbuf, zcount, MPI_DOUBLE, mpi.zlo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-          }
-          time.comms += MPI_Wtime() - comtime;
-
-          #pragma omp parallel for
-          for (int g = 0; g < opt.ng; g++) {
-
-            /* Do proportional "work" */
-            for (int w = 0; w < opt.nang*opt.chunklen*opt.ny*opt.nz; w++) {
-              compute();
-            }
-
-          } /* End group loop */
-
-          /* Send payload to downwind neighbours */
-          comtime = MPI_Wtime();
-          MPI_Waitall(2, req, MPI_STATUS_IGNORE);
-
-          if (j == 0) {
-            MPI_Isend(ybuf, ycount, MPI_DOUBLE, mpi.ylo, 0, MPI_COMM_WORLD, req+0);
-          }
-          else {
-            MPI_Isend(ybuf, ycount, MPI_DOUBLE, mpi.yhi, 0, MPI_COMM_WORLD, req+0);
-          }
-
-          if (k == 0) {
-            MPI_Isend(zbuf, zcount, MPI_DOUBLE, mpi.zlo, 0, MPI_COMM_WORLD, req+1);
-          }
-          else {
-            MPI_Isend(zbuf, zcount, MPI_DOUBLE, mpi.zhi, 0, MPI_COMM_WORLD, req+1);
-          }
-          time.comms += MPI_Wtime() - comtime;
-
-        } /* End nchunks loop */
-      } /* End i loop */
-    } /* End j loop */
-  } /* End k loop */
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Loop over messages to send per octant */
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      /* Receive payload from upwind neighbours, starting with the x face on the first chunk */
+      double comtime = MPI_Wtime();
+      if (c == 0) {
+        MPI_Wait(req+2, MPI_STATUS_IGNORE);
+        if (i == 0) {
+          MPI_Recv(xbuf, xcount, MPI_DOUBLE, mpi.xhi, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+        }
+        else {
+          MPI_Recv(xbuf, xcount, MPI_DOUBLE, mpi.xlo, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+        }
+      }
+
+      if (j == 0) {
+        MPI_Recv(ymsg[buf], ycount, ytype, mpi.yhi, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+      }
+      else {
+        MPI_Recv(ymsg[buf], ycount, ytype, mpi.ylo, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+      }
+
+      if (k == 0) {
+        MPI_Recv(zmsg[buf], zcount, ztype, mpi.zhi, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+      }
+      else {
+        MPI_Recv(zmsg[buf], zcount, ztype, mpi.zlo, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+      }
+
+      double packtime = MPI_Wtime();
+      unpack_face(opt, Y_FACE, ymsg[buf], ybuf[buf]);
+      unpack_face(opt, Z_FACE, zmsg[buf], zbuf[buf]);
+      time.packing += MPI_Wtime() - packtime;
+      time.comms += MPI_Wtime() - comtime;
+
+      #pragma omp parallel for
+      for (int g = 0; g < opt.ng; g++) {
+
+        /* Do proportional "work" */
+        compute_chunk(opt, oct, c, g, g, opt.ng, ybuf[buf], zbuf[buf], xbuf);
+
+      } /* End group loop */
+
+      /* Send payload to downwind neighbours */
+      comtime = MPI_Wtime();
+      MPI_Waitall(2, req, MPI_STATUS_IGNORE);
+
+      packtime = MPI_Wtime();
+      pack_face(opt, Y_FACE, ybuf[buf], ymsg[buf]);
+      pack_face(opt, Z_FACE, zbuf[buf], zmsg[buf]);
+      time.packing += MPI_Wtime() - packtime;
+
+      const int ydown = (j == 0) ? mpi.ylo : mpi.yhi;
+      const int zdown = (k == 0) ? mpi.zlo : mpi.zhi;
+      MPI_Isend(ymsg[buf], ycount, ytype, ydown, 0, mpi.comm, req+0);
+      MPI_Isend(zmsg[buf], zcount, ztype, zdown, 0, mpi.comm, req+1);
+      if (ydown != MPI_PROC_NULL) time.bytes += face_msg_bytes(opt, Y_FACE);
+      if (zdown != MPI_PROC_NULL) time.bytes += face_msg_bytes(opt, Z_FACE);
+
+      /* The x face leaves after the last chunk */
+      if (c == opt.nchunks-1) {
+        if (i == 0) {
+          MPI_Isend(xbuf, xcount, MPI_DOUBLE, mpi.xlo, 0, mpi.comm, req+2);
+        }
+        else {
+          MPI_Isend(xbuf, xcount, MPI_DOUBLE, mpi.xhi, 0, mpi.comm, req+2);
+        }
+      }
+      time.comms += MPI_Wtime() - comtime;
+
+      buf = 1 - buf;
+
+    } /* End nchunks loop */
+  } /* End octant loop */
+
+  /* Make sure the last faces have gone before the buffers are freed */
+  double comtime = MPI_Wtime();
+  MPI_Waitall(3, req, MPI_STATUS_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
 
   /* End the timer */
   double tock = MPI_Wtime();
 
   time.sweeping = tock-tick;
 
-  end_par_group_sweep(ybuf, zbuf);
-
   time.setup += MPI_Wtime() - tock;
 
   return time;
 }
 
 /* Allocate MPI message buffers */
-void init_par_group_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf) {
-  (*ybuf) = malloc(sizeof(double)*ycount);
-  (*zbuf) = malloc(sizeof(double)*zcount);
+void init_par_group_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  *xbuf = malloc(sizeof(double)*xcount);
 }
 
 /* Free MPI message buffers */
-void end_par_group_sweep(double *ybuf, double *zbuf) {
-  free(ybuf);
-  free(zbuf);
+void end_par_group_sweep(double **ybuf, double **zbuf, double *xbuf) {
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  free(xbuf);
 }
 
+
+/*
+ * Build the face buffers - two of each so that a receive never lands in
+ * a buffer which is still being sent from, and one for the x face - and
+ * the messages the y and z faces travel in, packed as selected with
+ * --pack and --precision. Those from an earlier sweep are kept if the
+ * faces are the same.
+ */
+void init_par_group_context(mpistate mpi, options opt) {
+  (void)mpi;
+  if (context) {
+    if (same_faces(context->opt, opt)) return;
+    end_par_group_context();
+  }
+
+  context = malloc(sizeof(par_group_context));
+  context->opt = opt;
+  const int xcount = opt.nang * opt.ny * opt.nz * opt.ng;
+  init_par_group_sweep(face_array_count(opt, Y_FACE), face_array_count(opt, Z_FACE), xcount, context->ybuf, context->zbuf, &context->xbuf);
+  init_face_types(opt);
+  for (int b = 0; b < 2; b++) {
+    context->ymsg[b] = init_face_msg(opt, Y_FACE, context->ybuf[b]);
+    context->zmsg[b] = init_face_msg(opt, Z_FACE, context->zbuf[b]);
+  }
+}
+
+/* Free the face buffers and messages */
+void end_par_group_context(void) {
+  if (!context) return;
+
+  for (int b = 0; b < 2; b++) {
+    end_face_msg(context->opt, context->ymsg[b]);
+    end_face_msg(context->opt, context->zmsg[b]);
+  }
+  end_face_types(context->opt);
+  end_par_group_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context);
+  context = NULL;
+}
@@ -25,8 +25,31 @@
 #include <stdlib.h>
 #include "sweep.h"
 
-void init_par_mpi_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf);
-void end_par_mpi_sweep(double *ybuf, double *zbuf);
+void init_par_mpi_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_par_mpi_sweep(double **ybuf, double **zbuf, double *xbuf);
+
+/*
+ * Message buffers kept between sweeps, along with the persistent
+ * requests bound to them with --persistent. They are kept until the
+ * face sizes, number of groups or --persistent change.
+ * Messages are matched by group and octant, so there is a set of requests
+ * for each group and octant, and for the y and z faces, each buffer.
+ */
+typedef struct par_mpi_context {
+  int ng, ycount, zcount, xcount;
+  int persistent;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf;
+
+  /* Indexed by (g*8 + oct)*2 + buf */
+  MPI_Request *yrecv, *zrecv, *ysend, *zsend;
+
+  /* Indexed by g*8 + oct */
+  MPI_Request *xrecv, *xsend;
+} par_mpi_context;
+
+static par_mpi_context *context = NULL;
 
 /* Perform a KBA sweep using OpenMP threads for concurrent group sweeps */
 timings par_mpi_sweep(mpistate mpi, options opt) {
@@ -37,8 +60,6 @@ timings par_mpi_sweep(mpistate mpi, options opt) {
     .comms = 0.0
   };
 
-  time.setup = MPI_Wtime();
-
   /* Check MPI threading model is high enough */
   if (mpi.thread_support < MPI_THREAD_SERIALIZED) {
     if (mpi.rank == 0) {
@@ -47,6 +68,20 @@ timings par_mpi_sweep(mpistate mpi, options opt) {
     }
   }
 
+  /*
+   * Message buffers - two of each so that a receive never lands in
+   * a buffer which is still being sent from, and one for the x face
+   */
+  init_par_mpi_context(mpi, opt);
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double *xbuf = context->xbuf;
+
+  time.setup = MPI_Wtime();
+
   /*
    * Need to use OpenMP locks if we are only MPI_THREAD_SERIALIZED.
    * We must ensure only one thread calls at once, and we cannot
@@ -59,122 +94,190 @@ timings par_mpi_sweep(mpistate mpi, options opt) {
     omp_init_lock(&lock);
   }
 
-  /* Message buffers */
-  const int ycount = opt.nang * opt.nz * opt.chunklen;
-  const int zcount = opt.nang * opt.ny * opt.chunklen;
-  double *ybuf;
-  double *zbuf;
-  init_par_mpi_sweep(opt.ng*ycount, opt.ng*zcount, &ybuf, &zbuf);
   time.setup = MPI_Wtime() - time.setup;
 
-  /* Send requests - 2 per thread */
+  /* Send requests - y, z and x per thread */
   int nthrds;
   #pragma omp parallel
   {
     nthrds = omp_get_num_threads();
   }
-  MPI_Request req[nthrds][2];
+  MPI_Request req[nthrds][3];
 #pragma omp parallel
   {
     req[omp_get_thread_num()][0] = MPI_REQUEST_NULL;
     req[omp_get_thread_num()][1] = MPI_REQUEST_NULL;
+    req[omp_get_thread_num()][2] = MPI_REQUEST_NULL;
   }
 
   /* Start the timer */
   double tick = MPI_Wtime();
 
-  /* Octant loops - 0 is stepping backwards, 1 is stepping forwards */
-  for (int k = 0; k < 2; k++) {
-    for (int j = 0; j < 2; j++) {
-      for (int i = 0; i < 2; i++) {
-
-        /* Loop over energy groups in parallel, setting up
-         * one concurrent sweep per group
-         */
-        #pragma omp parallel for
-        for (int g = 0; g < opt.ng; g++) {
-
-          const int thrd = omp_get_thread_num();
-
-          /* Loop over messages to send per octant */
-          for (int c = 0; c < opt.nchunks; c++) {
-
-            /* Receive payload from upwind neighbours */
-            double comtime = MPI_Wtime();
-
-            /* Lock if necessary before comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              omp_set_lock(&lock);
-            }
-
-            if (j == 0) {
-              MPI_Recv(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.yhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            else {
-              MPI_Recv(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.ylo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-
-            if (k == 0) {
-              MPI_Recv(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            else {
-              MPI_Recv(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zlo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-
-            /* Just time last thread */
-            if (thrd == nthrds-1) {
-              time.comms += MPI_Wtime() - comtime;
-            }
-
-            /* Unlock if necessary after comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              omp_unset_lock(&lock);
-            }
-
-            /* Do proportional "work" */
-            for (int w = 0; w < opt.nang*opt.chunklen*opt.ny*opt.nz; w++) {
-              compute();
-            }
-
-            /* Send payload to downwind neighbours */
-            comtime = MPI_Wtime();
-
-            /* Lock if necessary before comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              omp_set_lock(&lock);
-            }
-
-            MPI_Waitall(2, req[thrd], MPI_STATUS_IGNORE);
-
-            if (j == 0) {
-              MPI_Isend(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.ylo, 0, MPI_COMM_WORLD, req[thrd]+0);
-            }
-            else {
-              MPI_Isend(ybuf+g*ycount, ycount, MPI_DOUBLE, mpi.yhi, 0, MPI_COMM_WORLD, req[thrd]+0);
-            }
-
-            if (k == 0) {
-              MPI_Isend(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zlo, 0, MPI_COMM_WORLD, req[thrd]+1);
-            }
-            else {
-              MPI_Isend(zbuf+g*zcount, zcount, MPI_DOUBLE, mpi.zhi, 0, MPI_COMM_WORLD, req[thrd]+1);
-            }
-
-            /* Just time last thread */
-            if (thrd == nthrds-1) {
-              time.comms += MPI_Wtime() - comtime;
-            }
-
-            /* Unlock if necessary after comms */
-            if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
-              omp_unset_lock(&lock);
-            }
-
-          } /* End nchunks loop */
-        } /* End ng loop */
-      } /* End i loop */
-    } /* End j loop */
-  } /* End k loop */
+  /* Start parallel region, kept open across octants so that groups can run ahead into the next octant */
+#pragma omp parallel
+{
+
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Loop over energy groups in parallel, setting up
+     * one concurrent sweep per group.
+     * The static schedule gives each thread the same groups in every
+     * octant, so a group's octants are always swept in order.
+     */
+    #pragma omp for schedule(static) nowait
+    for (int g = 0; g < opt.ng; g++) {
+
+      const int thrd = omp_get_thread_num();
+
+      /* Each group's messages are matched on their own, by tag or communicator */
+      const MPI_Comm comm = group_comm(mpi, g);
+      const int tag = group_tag(opt, oct, g);
+
+      /* Loop over messages to send per octant */
+      for (int c = 0; c < opt.nchunks; c++) {
+
+        /* Alternate buffers between consecutive chunks of this group */
+        const int buf = (o*opt.nchunks + c) % 2;
+
+        /* Persistent requests for this group, octant and buffer */
+        const int preq = (g*8 + oct)*2 + buf;
+
+        /* Receive payload from upwind neighbours */
+        double comtime = MPI_Wtime();
+
+        /* Lock if necessary before comms */
+        if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
+          omp_set_lock(&lock);
+        }
+
+        /* The x face arrives before the first chunk, once this thread's last one has gone */
+        if (c == 0) {
+          MPI_Wait(req[thrd]+2, MPI_STATUS_IGNORE);
+          if (opt.persistent) {
+            MPI_Start(&context->xrecv[g*8 + oct]);
+            MPI_Wait(&context->xrecv[g*8 + oct], MPI_STATUS_IGNORE);
+          }
+          else if (i == 0) {
+            MPI_Recv(xbuf+g*xcount, xcount, MPI_DOUBLE, mpi.xhi, tag, comm, MPI_STATUS_IGNORE);
+          }
+          else {
+            MPI_Recv(xbuf+g*xcount, xcount, MPI_DOUBLE, mpi.xlo, tag, comm, MPI_STATUS_IGNORE);
+          }
+        }
+
+        if (opt.persistent) {
+          MPI_Request recv[2] = {context->yrecv[preq], context->zrecv[preq]};
+          MPI_Startall(2, recv);
+          MPI_Waitall(2, recv, MPI_STATUSES_IGNORE);
+        }
+        else {
+          if (j == 0) {
+            MPI_Recv(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, mpi.yhi, tag, comm, MPI_STATUS_IGNORE);
+          }
+          else {
+            MPI_Recv(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, mpi.ylo, tag, comm, MPI_STATUS_IGNORE);
+          }
+
+          if (k == 0) {
+            MPI_Recv(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, mpi.zhi, tag, comm, MPI_STATUS_IGNORE);
+          }
+          else {
+            MPI_Recv(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, mpi.zlo, tag, comm, MPI_STATUS_IGNORE);
+          }
+        }
+
+        /* Just time last thread */
+        if (thrd == nthrds-1) {
+          time.comms += MPI_Wtime() - comtime;
+        }
+
+        /* Unlock if necessary after comms */
+        if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
+          omp_unset_lock(&lock);
+        }
+
+        /* Do proportional "work" */
+        compute_chunk(opt, oct, c, g, 0, 1, ybuf[buf]+g*ycount, zbuf[buf]+g*zcount, xbuf+g*xcount);
+
+        /* Send payload to downwind neighbours */
+        comtime = MPI_Wtime();
+
+        /* Lock if necessary before comms */
+        if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
+          omp_set_lock(&lock);
+        }
+
+        MPI_Waitall(2, req[thrd], MPI_STATUS_IGNORE);
+
+        if (opt.persistent) {
+          req[thrd][0] = context->ysend[preq];
+          req[thrd][1] = context->zsend[preq];
+          MPI_Startall(2, req[thrd]);
+        }
+        else {
+          if (j == 0) {
+            MPI_Isend(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, mpi.ylo, tag, comm, req[thrd]+0);
+          }
+          else {
+            MPI_Isend(ybuf[buf]+g*ycount, ycount, MPI_DOUBLE, mpi.yhi, tag, comm, req[thrd]+0);
+          }
+
+          if (k == 0) {
+            MPI_Isend(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, mpi.zlo, tag, comm, req[thrd]+1);
+          }
+          else {
+            MPI_Isend(zbuf[buf]+g*zcount, zcount, MPI_DOUBLE, mpi.zhi, tag, comm, req[thrd]+1);
+          }
+        }
+
+        /* The x face leaves after the last chunk */
+        if (c == opt.nchunks-1) {
+          if (opt.persistent) {
+            req[thrd][2] = context->xsend[g*8 + oct];
+            MPI_Start(req[thrd]+2);
+          }
+          else if (i == 0) {
+            MPI_Isend(xbuf+g*xcount, xcount, MPI_DOUBLE, mpi.xlo, tag, comm, req[thrd]+2);
+          }
+          else {
+            MPI_Isend(xbuf+g*xcount, xcount, MPI_DOUBLE, mpi.xhi, tag, comm, req[thrd]+2);
+          }
+        }
+
+        /* Just time last thread */
+        if (thrd == nthrds-1) {
+          time.comms += MPI_Wtime() - comtime;
+        }
+
+        /* Unlock if necessary after comms */
+        if(mpi.thread_support == MPI_THREAD_SERIALIZED) {
+          omp_unset_lock(&lock);
+        }
+
+      } /* End nchunks loop */
+    } /* End ng loop */
+
+    /* Unless pipelining, every group finishes the octant before any start the next */
+    if (opt.octants == ORDERED_OCTANTS) {
+      #pragma omp barrier
+    }
+
+  } /* End octant loop */
+
+} /* End parallel region */
+
+  /* Make sure the last faces have gone before the buffers are used again */
+  double comtime = MPI_Wtime();
+  MPI_Waitall(3*nthrds, &req[0][0], MPI_STATUSES_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
 
   /* End the timer */
   double tock = MPI_Wtime();
@@ -185,7 +288,6 @@ timings par_mpi_sweep(mpistate mpi, options opt) {
   if (mpi.thread_support == MPI_THREAD_SERIALIZED) {
     omp_destroy_lock(&lock);
   }
-  end_par_mpi_sweep(ybuf, zbuf);
 
   time.setup += MPI_Wtime() - tock;
 
@@ -193,14 +295,106 @@ timings par_mpi_sweep(mpistate mpi, options opt) {
 }
 
 /* Allocate MPI message buffers */
-void init_par_mpi_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf) {
-  (*ybuf) = malloc(sizeof(double)*ycount);
-  (*zbuf) = malloc(sizeof(double)*zcount);
+void init_par_mpi_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  *xbuf = malloc(sizeof(double)*xcount);
 }
 
 /* Free MPI message buffers */
-void end_par_mpi_sweep(double *ybuf, double *zbuf) {
-  free(ybuf);
-  free(zbuf);
+void end_par_mpi_sweep(double **ybuf, double **zbuf, double *xbuf) {
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  free(xbuf);
+}
+
+
+/*
+ * Build the buffers, and the persistent requests with --persistent,
+ * unless those from an earlier sweep are still right.
+ * The receive for a direction comes from the hi neighbour when stepping
+ * backwards, and the send goes to the lo neighbour.
+ */
+void init_par_mpi_context(mpistate mpi, options opt) {
+  const int ycount = opt.nang * opt.nz * opt.chunklen;
+  const int zcount = opt.nang * opt.ny * opt.chunklen;
+  const int xcount = opt.nang * opt.ny * opt.nz;
+  if (context) {
+    if (context->ng == opt.ng && context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->persistent == opt.persistent) return;
+    end_par_mpi_context();
+  }
+
+  context = malloc(sizeof(par_mpi_context));
+  context->ng = opt.ng;
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->persistent = opt.persistent;
+  init_par_mpi_sweep(opt.ng*ycount, opt.ng*zcount, opt.ng*xcount, context->ybuf, context->zbuf, &context->xbuf);
+  if (!opt.persistent) return;
+
+  const int nreq = opt.ng*8*2;
+  context->yrecv = malloc(sizeof(MPI_Request)*nreq);
+  context->zrecv = malloc(sizeof(MPI_Request)*nreq);
+  context->ysend = malloc(sizeof(MPI_Request)*nreq);
+  context->zsend = malloc(sizeof(MPI_Request)*nreq);
+  context->xrecv = malloc(sizeof(MPI_Request)*opt.ng*8);
+  context->xsend = malloc(sizeof(MPI_Request)*opt.ng*8);
+
+  for (int g = 0; g < opt.ng; g++) {
+    const MPI_Comm comm = group_comm(mpi, g);
+    for (int oct = 0; oct < 8; oct++) {
+      const int tag = group_tag(opt, oct, g);
+      const int xup = ((oct & 1) == 0) ? mpi.xhi : mpi.xlo;
+      const int xdown = ((oct & 1) == 0) ? mpi.xlo : mpi.xhi;
+      const int yup = (((oct >> 1) & 1) == 0) ? mpi.yhi : mpi.ylo;
+      const int ydown = (((oct >> 1) & 1) == 0) ? mpi.ylo : mpi.yhi;
+      const int zup = (((oct >> 2) & 1) == 0) ? mpi.zhi : mpi.zlo;
+      const int zdown = (((oct >> 2) & 1) == 0) ? mpi.zlo : mpi.zhi;
+      for (int b = 0; b < 2; b++) {
+        const int r = (g*8 + oct)*2 + b;
+        double *y = context->ybuf[b] + g*ycount;
+        double *z = context->zbuf[b] + g*zcount;
+        MPI_Recv_init(y, ycount, MPI_DOUBLE, yup, tag, comm, &context->yrecv[r]);
+        MPI_Recv_init(z, zcount, MPI_DOUBLE, zup, tag, comm, &context->zrecv[r]);
+        MPI_Send_init(y, ycount, MPI_DOUBLE, ydown, tag, comm, &context->ysend[r]);
+        MPI_Send_init(z, zcount, MPI_DOUBLE, zdown, tag, comm, &context->zsend[r]);
+      }
+      double *x = context->xbuf + g*xcount;
+      MPI_Recv_init(x, xcount, MPI_DOUBLE, xup, tag, comm, &context->xrecv[g*8 + oct]);
+      MPI_Send_init(x, xcount, MPI_DOUBLE, xdown, tag, comm, &context->xsend[g*8 + oct]);
+    }
+  }
 }
 
+/* Free the buffers, and the persistent requests */
+void end_par_mpi_context(void) {
+  if (!context) return;
+
+  if (context->persistent) {
+    const int nreq = context->ng*8*2;
+    for (int r = 0; r < nreq; r++) {
+      MPI_Request_free(&context->yrecv[r]);
+      MPI_Request_free(&context->zrecv[r]);
+      MPI_Request_free(&context->ysend[r]);
+      MPI_Request_free(&context->zsend[r]);
+    }
+    for (int r = 0; r < context->ng*8; r++) {
+      MPI_Request_free(&context->xrecv[r]);
+      MPI_Request_free(&context->xsend[r]);
+    }
+    free(context->yrecv);
+    free(context->zrecv);
+    free(context->ysend);
+    free(context->zsend);
+    free(context->xrecv);
+    free(context->xsend);
+  }
+  end_par_mpi_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context);
+  context = NULL;
+}
@@ -0,0 +1,343 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include <omp.h>
+#include "options.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "sweep.h"
+
+#if MPI_VERSION >= 4
+
+void init_partitioned_sweep(mpistate mpi, options opt, const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf, MPI_Request *yrecv, MPI_Request *zrecv, MPI_Request *xrecv, MPI_Request *ysend, MPI_Request *zsend, MPI_Request *xsend);
+void end_partitioned_sweep(double **ybuf, double **zbuf, double **xbuf, MPI_Request *yrecv, MPI_Request *zrecv, MPI_Request *xrecv, MPI_Request *ysend, MPI_Request *zsend, MPI_Request *xsend);
+void wait_partitions(MPI_Request req, int g);
+void start_partitioned(MPI_Request *req);
+
+/*
+ * Message buffers and the partitioned requests bound to them, kept
+ * between sweeps until the face sizes or the number of groups change.
+ * Requests are indexed by direction, where 0 is stepping backwards,
+ * and buffer, as direction*2 + buffer.
+ */
+typedef struct partitioned_context {
+  int ycount, zcount, xcount, ng;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf[2];
+  MPI_Request yrecv[4], zrecv[4], xrecv[4];
+  MPI_Request ysend[4], zsend[4], xsend[4];
+} partitioned_context;
+
+static partitioned_context *context = NULL;
+
+/*
+ * Perform a KBA sweep threading over groups inside the chunk, sending
+ * each face as one partitioned message with a partition per group.
+ *
+ * The partitioned requests are built once, for each direction and
+ * buffer, and kept between sweeps. For each chunk one thread starts the receives and sends, and
+ * then each thread sweeps its groups as soon as their partitions have
+ * arrived, and marks the group's outgoing partitions ready as soon as it
+ * is done. Each group is pipelined on its own, but a face is matched as
+ * a single message.
+ */
+timings partitioned_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  /* Threads test and mark partitions concurrently */
+  if (mpi.thread_support < MPI_THREAD_MULTIPLE) {
+    if (mpi.rank == 0) {
+      printf("MPI library must support MPI_THREAD_MULTIPLE\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+
+  /* Message buffers and partitioned requests, built before the first sweep */
+  init_partitioned_context(mpi, opt);
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double **xbuf = context->xbuf;
+  const MPI_Request *yrecv = context->yrecv;
+  const MPI_Request *zrecv = context->zrecv;
+  const MPI_Request *xrecv = context->xrecv;
+  const MPI_Request *ysend = context->ysend;
+  const MPI_Request *zsend = context->zsend;
+  const MPI_Request *xsend = context->xsend;
+
+  time.setup = MPI_Wtime();
+
+  /* Requests last started on each buffer - y and z receives and sends */
+  MPI_Request active[2][4];
+  for (int b = 0; b < 2; b++) {
+    for (int r = 0; r < 4; r++) {
+      active[b][r] = MPI_REQUEST_NULL;
+    }
+  }
+
+  /* Requests last started on each x buffer - receive and send */
+  MPI_Request xactive[2][2] = {{MPI_REQUEST_NULL, MPI_REQUEST_NULL}, {MPI_REQUEST_NULL, MPI_REQUEST_NULL}};
+  time.setup = MPI_Wtime() - time.setup;
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+#pragma omp parallel
+{
+
+  const int thrd = omp_get_thread_num();
+  const int nthrds = omp_get_num_threads();
+
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Loop over messages to send per octant */
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      /* Alternate buffers between consecutive chunks */
+      const int buf = (o*opt.nchunks + c) % 2;
+
+      /*
+       * Start this chunk's messages once those last started on the buffer
+       * have completed. Every thread has finished the chunk before last by
+       * the end of the previous single, so their partitions are all ready.
+       */
+      #pragma omp single
+      {
+        double comtime = MPI_Wtime();
+        MPI_Waitall(4, active[buf], MPI_STATUSES_IGNORE);
+        active[buf][0] = yrecv[j*2 + buf];
+        active[buf][1] = zrecv[k*2 + buf];
+        active[buf][2] = ysend[j*2 + buf];
+        active[buf][3] = zsend[k*2 + buf];
+        for (int r = 0; r < 4; r++) {
+          start_partitioned(&active[buf][r]);
+        }
+
+        /*
+         * The x face is received before the first chunk, into the buffer
+         * the octant before last used once its send has gone
+         */
+        if (c == 0) {
+          MPI_Waitall(2, xactive[o%2], MPI_STATUSES_IGNORE);
+          xactive[o%2][0] = xrecv[i*2 + o%2];
+          xactive[o%2][1] = xsend[i*2 + o%2];
+          start_partitioned(&xactive[o%2][0]);
+          start_partitioned(&xactive[o%2][1]);
+        }
+        comtime = MPI_Wtime() - comtime;
+        #pragma omp atomic
+        time.comms += comtime;
+      }
+
+      /*
+       * The static schedule gives each thread the same groups in every
+       * chunk, so a group's chunks are always swept in order.
+       */
+      #pragma omp for schedule(static) nowait
+      for (int g = 0; g < opt.ng; g++) {
+
+        /* Wait for this group's partitions from upwind neighbours */
+        double comtime = MPI_Wtime();
+        if (c == 0) {
+          wait_partitions(xactive[o%2][0], g);
+        }
+        wait_partitions(active[buf][0], g);
+        wait_partitions(active[buf][1], g);
+
+        /* Just time last thread */
+        if (thrd == nthrds-1) {
+          comtime = MPI_Wtime() - comtime;
+          #pragma omp atomic
+          time.comms += comtime;
+        }
+
+        /* Do proportional "work" */
+        compute_chunk(opt, oct, c, g, 0, 1, ybuf[buf]+g*ycount, zbuf[buf]+g*zcount, xbuf[o%2]+g*xcount);
+
+        /* Send this group's partitions to downwind neighbours, with the x face after the last chunk */
+        if (active[buf][2] != MPI_REQUEST_NULL) MPI_Pready(g, active[buf][2]);
+        if (active[buf][3] != MPI_REQUEST_NULL) MPI_Pready(g, active[buf][3]);
+        if (c == opt.nchunks-1 && xactive[o%2][1] != MPI_REQUEST_NULL) {
+          MPI_Pready(g, xactive[o%2][1]);
+        }
+
+      } /* End group loop */
+    } /* End nchunks loop */
+  } /* End octant loop */
+
+} /* End parallel region */
+
+  /* Make sure the last faces have gone before the requests are started again */
+  double comtime = MPI_Wtime();
+  MPI_Waitall(8, &active[0][0], MPI_STATUSES_IGNORE);
+  MPI_Waitall(4, &xactive[0][0], MPI_STATUSES_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/* Start a partitioned request, unless there is no neighbour */
+void start_partitioned(MPI_Request *req) {
+  if (*req != MPI_REQUEST_NULL) {
+    MPI_Start(req);
+  }
+}
+
+/* Spin until a partition of a started receive has arrived */
+void wait_partitions(MPI_Request req, int g) {
+  if (req == MPI_REQUEST_NULL) return;
+  int arrived = 0;
+  while (!arrived) {
+    MPI_Parrived(req, g, &arrived);
+  }
+}
+
+/*
+ * Allocate MPI message buffers and build the partitioned requests.
+ * The receive for a direction comes from the hi neighbour when stepping
+ * backwards, and the send goes to the lo neighbour. Each pair of ranks
+ * only exchanges one face in each direction, so the buffer is the tag,
+ * offset by two for the x face.
+ * There are no requests on the edges of the domain.
+ */
+void init_partitioned_sweep(mpistate mpi, options opt, const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf, MPI_Request *yrecv, MPI_Request *zrecv, MPI_Request *xrecv, MPI_Request *ysend, MPI_Request *zsend, MPI_Request *xsend) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount*opt.ng);
+    zbuf[b] = malloc(sizeof(double)*zcount*opt.ng);
+    xbuf[b] = malloc(sizeof(double)*xcount*opt.ng);
+  }
+
+  const int xup[2] = {mpi.xhi, mpi.xlo};
+  const int yup[2] = {mpi.yhi, mpi.ylo};
+  const int zup[2] = {mpi.zhi, mpi.zlo};
+  for (int d = 0; d < 2; d++) {
+    for (int b = 0; b < 2; b++) {
+      const int r = d*2 + b;
+      yrecv[r] = ysend[r] = zrecv[r] = zsend[r] = xrecv[r] = xsend[r] = MPI_REQUEST_NULL;
+      if (yup[d] != MPI_PROC_NULL) MPI_Precv_init(ybuf[b], opt.ng, ycount, MPI_DOUBLE, yup[d], b, mpi.comm, MPI_INFO_NULL, &yrecv[r]);
+      if (yup[1-d] != MPI_PROC_NULL) MPI_Psend_init(ybuf[b], opt.ng, ycount, MPI_DOUBLE, yup[1-d], b, mpi.comm, MPI_INFO_NULL, &ysend[r]);
+      if (zup[d] != MPI_PROC_NULL) MPI_Precv_init(zbuf[b], opt.ng, zcount, MPI_DOUBLE, zup[d], b, mpi.comm, MPI_INFO_NULL, &zrecv[r]);
+      if (zup[1-d] != MPI_PROC_NULL) MPI_Psend_init(zbuf[b], opt.ng, zcount, MPI_DOUBLE, zup[1-d], b, mpi.comm, MPI_INFO_NULL, &zsend[r]);
+      if (xup[d] != MPI_PROC_NULL) MPI_Precv_init(xbuf[b], opt.ng, xcount, MPI_DOUBLE, xup[d], 2+b, mpi.comm, MPI_INFO_NULL, &xrecv[r]);
+      if (xup[1-d] != MPI_PROC_NULL) MPI_Psend_init(xbuf[b], opt.ng, xcount, MPI_DOUBLE, xup[1-d], 2+b, mpi.comm, MPI_INFO_NULL, &xsend[r]);
+    }
+  }
+}
+
+/* Free the partitioned requests and MPI message buffers */
+void end_partitioned_sweep(double **ybuf, double **zbuf, double **xbuf, MPI_Request *yrecv, MPI_Request *zrecv, MPI_Request *xrecv, MPI_Request *ysend, MPI_Request *zsend, MPI_Request *xsend) {
+  for (int r = 0; r < 4; r++) {
+    if (yrecv[r] != MPI_REQUEST_NULL) MPI_Request_free(&yrecv[r]);
+    if (ysend[r] != MPI_REQUEST_NULL) MPI_Request_free(&ysend[r]);
+    if (zrecv[r] != MPI_REQUEST_NULL) MPI_Request_free(&zrecv[r]);
+    if (zsend[r] != MPI_REQUEST_NULL) MPI_Request_free(&zsend[r]);
+    if (xrecv[r] != MPI_REQUEST_NULL) MPI_Request_free(&xrecv[r]);
+    if (xsend[r] != MPI_REQUEST_NULL) MPI_Request_free(&xsend[r]);
+  }
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+    free(xbuf[b]);
+  }
+}
+
+/*
+ * Build the message buffers - two of each so that a receive never lands
+ * in a buffer which is still being sent from, each holding a partition
+ * of one group's face for every group - and their partitioned requests,
+ * unless those from an earlier sweep are still right.
+ * The x face alternates between octants, the y and z faces between chunks.
+ */
+void init_partitioned_context(mpistate mpi, options opt) {
+  const int ycount = opt.nang * opt.nz * opt.chunklen;
+  const int zcount = opt.nang * opt.ny * opt.chunklen;
+  const int xcount = opt.nang * opt.ny * opt.nz;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->ng == opt.ng) return;
+    end_partitioned_context();
+  }
+
+  context = malloc(sizeof(partitioned_context));
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->ng = opt.ng;
+  init_partitioned_sweep(mpi, opt, ycount, zcount, xcount, context->ybuf, context->zbuf, context->xbuf, context->yrecv, context->zrecv, context->xrecv, context->ysend, context->zsend, context->xsend);
+}
+
+/* Free the message buffers and partitioned requests */
+void end_partitioned_context(void) {
+  if (!context) return;
+
+  end_partitioned_sweep(context->ybuf, context->zbuf, context->xbuf, context->yrecv, context->zrecv, context->xrecv, context->ysend, context->zsend, context->xsend);
+  free(context);
+  context = NULL;
+}
+
+#else
+
+/* Partitioned communication needs an MPI 4 library */
+timings partitioned_sweep(mpistate mpi, options opt) {
+  (void)opt;
+  if (mpi.rank == 0) {
+    printf("The partitioned sweeper needs MPI 4, but this library supports MPI %d.%d\n", MPI_VERSION, MPI_SUBVERSION);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  MPI_Barrier(mpi.comm);
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+  return time;
+}
+
+/* Nothing is kept without MPI 4, as the sweep stops straight away */
+void init_partitioned_context(mpistate mpi, options opt) {
+  (void)mpi;
+  (void)opt;
+}
+
+void end_partitioned_context(void) {
+}
+
+#endif
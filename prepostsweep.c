@@ -0,0 +1,276 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include "options.h"
+#include <stdlib.h>
+#include "sweep.h"
+
+void init_prepost_sweep(const int ycount, const int zcount, const int xcount, const int npool, double **ybuf, double **zbuf, double **xbuf);
+void end_prepost_sweep(const int npool, double **ybuf, double **zbuf, double **xbuf);
+void prepost_faces(mpistate mpi, options opt, int step, double *ybuf, double *zbuf, int ycount, int zcount, MPI_Request *req);
+
+/*
+ * Message buffers, the rings of them and their requests, kept between
+ * sweeps until the face sizes or --nbufs change. The rings are dealt
+ * out afresh by each sweep.
+ */
+typedef struct prepost_context {
+  int ycount, zcount, xcount, nbufs;
+  double **ybuf;
+  double **zbuf;
+  double *xbuf[2];
+  int *recvbuf;
+  int *sendbuf;
+  MPI_Request *recvreq;
+  MPI_Request *sendreq;
+} prepost_context;
+
+static prepost_context *context = NULL;
+
+/*
+ * Perform a KBA sweep threading over groups inside the chunk, with the
+ * receives for the next nbufs chunks always posted.
+ *
+ * Chunks are numbered by step across all the octants. The receive for a
+ * step is posted nbufs steps ahead into one ring of buffers, and its faces
+ * are updated in place and sent from there. The buffer then moves to a
+ * second ring of sends, and the send buffer it replaces, once that send has
+ * completed, takes its place to receive the step nbufs further on. No face
+ * is copied, and the sweep only waits for the faces it is about to use or
+ * for a buffer it is about to reuse.
+ */
+timings prepost_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  /* Message buffers, rings and requests, built before the first sweep */
+  init_prepost_context(mpi, opt);
+  const int nbufs = context->nbufs;
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double **xbuf = context->xbuf;
+  int *recvbuf = context->recvbuf;
+  int *sendbuf = context->sendbuf;
+  MPI_Request *recvreq = context->recvreq;
+  MPI_Request *sendreq = context->sendreq;
+
+  time.setup = MPI_Wtime();
+
+  /* Pool buffers in the receive and send rings */
+  for (int b = 0; b < nbufs; b++) {
+    recvbuf[b] = b;
+    sendbuf[b] = nbufs + b;
+  }
+
+  /* Requests for the y and z faces of each ring slot, and the x faces */
+  for (int r = 0; r < 2*nbufs; r++) {
+    recvreq[r] = MPI_REQUEST_NULL;
+    sendreq[r] = MPI_REQUEST_NULL;
+  }
+  MPI_Request xrecvreq[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+  MPI_Request xsendreq[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+  time.setup = MPI_Wtime() - time.setup;
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+  /* Fill the receive ring, and post the first octant's x face */
+  const int nsteps = 8 * opt.nchunks;
+  double comtime = MPI_Wtime();
+  for (int t = 0; t < nbufs && t < nsteps; t++) {
+    prepost_faces(mpi, opt, t, ybuf[recvbuf[t]], zbuf[recvbuf[t]], ycount, zcount, recvreq+2*t);
+  }
+  {
+    const int oct = octant_order[opt.octants][0];
+    const int xup = ((oct & 1) == 0) ? mpi.xhi : mpi.xlo;
+    MPI_Irecv(xbuf[0], xcount, MPI_DOUBLE, xup, oct, mpi.comm, xrecvreq+0);
+  }
+  time.comms += MPI_Wtime() - comtime;
+
+  for (int t = 0; t < nsteps; t++) {
+
+    const int o = t / opt.nchunks;
+    const int c = t % opt.nchunks;
+    const int oct = octant_order[opt.octants][o];
+    const int r = t % nbufs;
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Wait for this chunk's faces, and on the first chunk the x face */
+    comtime = MPI_Wtime();
+    if (c == 0) {
+      MPI_Wait(xrecvreq + o%2, MPI_STATUS_IGNORE);
+
+      /* Post the next octant's x face into the other buffer once it has been sent on */
+      if (o < 7) {
+        const int next = octant_order[opt.octants][o+1];
+        const int xup = ((next & 1) == 0) ? mpi.xhi : mpi.xlo;
+        MPI_Wait(xsendreq + (o+1)%2, MPI_STATUS_IGNORE);
+        MPI_Irecv(xbuf[(o+1)%2], xcount, MPI_DOUBLE, xup, next, mpi.comm, xrecvreq + (o+1)%2);
+      }
+    }
+    MPI_Waitall(2, recvreq+2*r, MPI_STATUSES_IGNORE);
+    time.comms += MPI_Wtime() - comtime;
+
+    double *y = ybuf[recvbuf[r]];
+    double *z = zbuf[recvbuf[r]];
+
+    #pragma omp parallel for
+    for (int g = 0; g < opt.ng; g++) {
+
+      /* Do proportional "work" */
+      compute_chunk(opt, oct, c, g, g, opt.ng, y, z, xbuf[o%2]);
+
+    } /* End group loop */
+
+    /* Swap the buffer into the send ring, taking back the one sent nbufs steps ago */
+    comtime = MPI_Wtime();
+    MPI_Waitall(2, sendreq+2*r, MPI_STATUSES_IGNORE);
+    const int sent = sendbuf[r];
+    sendbuf[r] = recvbuf[r];
+    recvbuf[r] = sent;
+
+    /* Send payload to downwind neighbours */
+    const int ydown = (j == 0) ? mpi.ylo : mpi.yhi;
+    const int zdown = (k == 0) ? mpi.zlo : mpi.zhi;
+    MPI_Isend(y, ycount, MPI_DOUBLE, ydown, oct, mpi.comm, sendreq+2*r);
+    MPI_Isend(z, zcount, MPI_DOUBLE, zdown, oct, mpi.comm, sendreq+2*r+1);
+
+    /* The x face leaves after the last chunk */
+    if (c == opt.nchunks-1) {
+      const int xdown = (i == 0) ? mpi.xlo : mpi.xhi;
+      MPI_Isend(xbuf[o%2], xcount, MPI_DOUBLE, xdown, oct, mpi.comm, xsendreq + o%2);
+    }
+
+    /* Refill the receive slot */
+    if (t + nbufs < nsteps) {
+      prepost_faces(mpi, opt, t + nbufs, ybuf[recvbuf[r]], zbuf[recvbuf[r]], ycount, zcount, recvreq+2*r);
+    }
+    time.comms += MPI_Wtime() - comtime;
+
+  } /* End step loop */
+
+  /* Make sure the last faces have gone before the buffers are used again */
+  comtime = MPI_Wtime();
+  MPI_Waitall(2*nbufs, sendreq, MPI_STATUSES_IGNORE);
+  MPI_Waitall(2, xsendreq, MPI_STATUSES_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/*
+ * Post the receives for the y and z faces of a step from the upwind neighbours.
+ * Each neighbour sends its faces in step order, so they match in the order posted.
+ */
+void prepost_faces(mpistate mpi, options opt, int step, double *ybuf, double *zbuf, int ycount, int zcount, MPI_Request *req) {
+  const int oct = octant_order[opt.octants][step / opt.nchunks];
+  const int yup = (((oct >> 1) & 1) == 0) ? mpi.yhi : mpi.ylo;
+  const int zup = (((oct >> 2) & 1) == 0) ? mpi.zhi : mpi.zlo;
+  MPI_Irecv(ybuf, ycount, MPI_DOUBLE, yup, oct, mpi.comm, req+0);
+  MPI_Irecv(zbuf, zcount, MPI_DOUBLE, zup, oct, mpi.comm, req+1);
+}
+
+/* Allocate MPI message buffers */
+void init_prepost_sweep(const int ycount, const int zcount, const int xcount, const int npool, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < npool; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  for (int b = 0; b < 2; b++) {
+    xbuf[b] = malloc(sizeof(double)*xcount);
+  }
+}
+
+/* Free MPI message buffers */
+void end_prepost_sweep(const int npool, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < npool; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  for (int b = 0; b < 2; b++) {
+    free(xbuf[b]);
+  }
+}
+
+
+/*
+ * Build the message buffers - a pool of twice the ring size for the y and
+ * z faces, and two x faces so the next octant's can be received during
+ * this one - the receive and send rings, and their requests, unless those
+ * from an earlier sweep are still right.
+ */
+void init_prepost_context(mpistate mpi, options opt) {
+  (void)mpi;
+  const int ycount = opt.nang * opt.nz * opt.chunklen * opt.ng;
+  const int zcount = opt.nang * opt.ny * opt.chunklen * opt.ng;
+  const int xcount = opt.nang * opt.ny * opt.nz * opt.ng;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->nbufs == opt.nbufs) return;
+    end_prepost_context();
+  }
+
+  context = malloc(sizeof(prepost_context));
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->nbufs = opt.nbufs;
+
+  const int npool = 2 * opt.nbufs;
+  context->ybuf = malloc(sizeof(double *)*npool);
+  context->zbuf = malloc(sizeof(double *)*npool);
+  init_prepost_sweep(ycount, zcount, xcount, npool, context->ybuf, context->zbuf, context->xbuf);
+
+  context->recvbuf = malloc(sizeof(int)*opt.nbufs);
+  context->sendbuf = malloc(sizeof(int)*opt.nbufs);
+  context->recvreq = malloc(sizeof(MPI_Request)*2*opt.nbufs);
+  context->sendreq = malloc(sizeof(MPI_Request)*2*opt.nbufs);
+}
+
+/* Free the message buffers, rings and requests */
+void end_prepost_context(void) {
+  if (!context) return;
+
+  end_prepost_sweep(2 * context->nbufs, context->ybuf, context->zbuf, context->xbuf);
+  free(context->ybuf);
+  free(context->zbuf);
+  free(context->recvbuf);
+  free(context->sendbuf);
+  free(context->recvreq);
+  free(context->sendreq);
+  free(context);
+  context = NULL;
+}
@@ -0,0 +1,150 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "options.h"
+#include <stdio.h>
+#include <string.h>
+#include "sweep.h"
+
+void describe_multi_corner(options opt);
+void describe_prepost(options opt);
+void describe_bundled(options opt);
+void describe_angle_sets(options opt);
+int one_message(options opt);
+int message_per_group(options opt);
+int message_per_bundle(options opt);
+int message_per_set(options opt);
+
+const sweeper_desc sweepers[NSWEEPERS] = {
+  [SERIAL] = {
+    .name = "serial", .title = "serial sweeper",
+    .init = init_serial_context, .run = serial_sweep, .end = end_serial_context,
+    .threaded = 0, .msgs = message_per_group, .persistent = 1
+  },
+  [PARGROUP] = {
+    .name = "pargroup", .title = "parallel group sweeper",
+    .init = init_par_group_context, .run = par_group_sweep, .end = end_par_group_context,
+    .threaded = 1, .msgs = one_message, .wire = 1, .flux_array = 1
+  },
+  [PARMPI] = {
+    .name = "parmpi", .title = "parallel MPI sweeper",
+    .init = init_par_mpi_context, .run = par_mpi_sweep, .end = end_par_mpi_context,
+    .threaded = 1, .msgs = message_per_group, .persistent = 1, .group_match = 1
+  },
+  [MULTILOCK] = {
+    .name = "multilock", .title = "parallel MPI sweeper (work stealing)",
+    .init = init_par_mpi_multi_lock_context, .run = par_mpi_multi_lock_sweep, .end = end_par_mpi_multi_lock_context,
+    .threaded = 1, .msgs = message_per_group, .group_match = 1
+  },
+  [FUNNELED] = {
+    .name = "funneled", .title = "parallel MPI sweeper (funneled)",
+    .init = init_funneled_context, .run = funneled_sweep, .end = end_funneled_context,
+    .threaded = 1, .msgs = message_per_group, .group_match = 1
+  },
+  [ONESIDED] = {
+    .name = "onesided", .title = "one sided sweeper",
+    .init = init_one_sided_context, .run = one_sided_sweep, .end = end_one_sided_sweep,
+    .threaded = 1, .msgs = one_message
+  },
+  [PSCW] = {
+    .name = "pscw", .title = "active target one sided sweeper",
+    .init = init_pscw_context, .run = pscw_sweep, .end = end_one_sided_sweep,
+    .threaded = 1, .msgs = one_message
+  },
+  [MULTICORNER] = {
+    .name = "multicorner", .title = "multi-corner sweeper", .describe = describe_multi_corner,
+    .init = init_multi_corner_context, .run = multi_corner_sweep, .end = end_multi_corner_context,
+    .threaded = 1, .msgs = one_message
+  },
+  [TASKGRAPH] = {
+    .name = "taskgraph", .title = "task graph sweeper",
+    .init = init_task_graph_context, .run = task_graph_sweep, .end = end_task_graph_context,
+    .threaded = 1, .msgs = message_per_group
+  },
+  [PREPOST] = {
+    .name = "prepost", .title = "pre-posted sweeper", .describe = describe_prepost,
+    .init = init_prepost_context, .run = prepost_sweep, .end = end_prepost_context,
+    .threaded = 1, .msgs = one_message
+  },
+  [BUNDLED] = {
+    .name = "bundled", .title = "bundled sweeper", .describe = describe_bundled,
+    .init = init_bundled_context, .run = bundled_sweep, .end = end_bundled_context,
+    .threaded = 1, .msgs = message_per_bundle, .wire = 1
+  },
+  [ANGLESETS] = {
+    .name = "anglesets", .title = "angle set sweeper", .describe = describe_angle_sets,
+    .init = init_angle_set_context, .run = angle_set_sweep, .end = end_angle_set_context,
+    .threaded = 1, .msgs = message_per_set, .wire = 1
+  },
+  [PARTITIONED] = {
+    .name = "partitioned", .title = "partitioned sweeper",
+    .init = init_partitioned_context, .run = partitioned_sweep, .end = end_partitioned_context,
+    .threaded = 1, .msgs = one_message
+  },
+  [SHARED] = {
+    .name = "shared", .title = "shared memory sweeper",
+    .init = init_shared_context, .run = shared_sweep, .end = end_shared_context,
+    .threaded = 1, .msgs = one_message
+  }
+};
+
+const sweeper_desc *find_sweeper(const char *name) {
+  for (int s = 0; s < NSWEEPERS; s++) {
+    if (strcmp(sweepers[s].name, name) == 0) return &sweepers[s];
+  }
+  return NULL;
+}
+
+void describe_multi_corner(options opt) {
+  printf("Running multi-corner sweeper (%s priority)\n", (opt.priority == DEPTH_PRIORITY) ? "depth first" : "earliest start");
+}
+
+void describe_prepost(options opt) {
+  printf("Running pre-posted sweeper (%d buffers)\n", opt.nbufs);
+}
+
+void describe_bundled(options opt) {
+  if (opt.groups_per_msg > 0) printf("Running bundled sweeper (%d groups per message)\n", opt.groups_per_msg);
+  else printf("Running bundled sweeper (groups per message from the model)\n");
+}
+
+void describe_angle_sets(options opt) {
+  printf("Running angle set sweeper (%d angle sets)\n", opt.angle_sets);
+}
+
+/* All the groups of a face in one message */
+int one_message(options opt) {
+  (void)opt;
+  return 1;
+}
+
+/* A message for each group */
+int message_per_group(options opt) {
+  return opt.ng;
+}
+
+/* A message for each bundle of --groups-per-msg groups */
+int message_per_bundle(options opt) {
+  return (opt.ng + opt.groups_per_msg - 1) / opt.groups_per_msg;
+}
+
+/* A message for each angle set */
+int message_per_set(options opt) {
+  return opt.angle_sets;
+}
@@ -16,19 +16,24 @@
  */
 
 
+#include "autotune.h"
 #include "comms.h"
+#include "compute.h"
 #include <mpi.h>
+#include "model.h"
 #include "options.h"
+#include "pack.h"
 #include "sweep.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "transport.h"
+#include "wire.h"
 
 #define VERSION "0.0"
 
-enum sweep {SERIAL, PARGROUP, PARMPI, MULTILOCK, ONESIDED};
-
 void print_timings(options opt, timings *times);
+timings run_sweep(mpistate mpi, options opt);
 void parse_args(mpistate mpi, int argc, char *argv[], options *opt);
 
 int main(int argc, char *argv[]) {
@@ -50,9 +55,25 @@ int main(int argc, char *argv[]) {
     .chunklen = 1,
     .ny = 1,
     .nz = 1,
+    .npex = 1,
+    .placement = NODE_PLACEMENT,
     .nang = 10,
+    .angle_sets = 1,
     .ng = 16,
-    .strong = 0
+    .strong = 0,
+    .autotune = 0,
+    .persistent = 0,
+    .match = TAG_MATCH,
+    .precision = FP64_WIRE,
+    .pack = CONTIGUOUS_PACK,
+    .octants = ORDERED_OCTANTS,
+    .priority = DEPTH_PRIORITY,
+    .nbufs = 4,
+    .groups_per_msg = 0,
+    .kernel = FLOPS,
+    .work = WORK,
+    .wset = 0,
+    .layout = ANGLE_LAYOUT
   };
 
   parse_args(mpi, argc, argv, &opt);
@@ -81,65 +102,149 @@ int main(int argc, char *argv[]) {
 
   }
 
-  /* Perform 2D decomposition in YZ */
+  /* Perform decomposition in YZ, and optionally X */
+  mpi.npex = opt.npex;
+  mpi.placement = opt.placement;
+  int gnx;
   if (opt.strong) {
+    gnx = opt.nchunks*opt.chunklen;
     decompose_mesh(&mpi, &opt);
   }
   else {
     decompose(&mpi);
+    gnx = mpi.npex*opt.nchunks*opt.chunklen;
     opt.gny = mpi.npey*opt.ny;
     opt.gnz = mpi.npez*opt.nz;
-    printf("Rank %d: ylo %d yhi %d, zlo %d, zhi %d\n", mpi.rank, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi);
+    printf("Rank %d: xlo %d xhi %d, ylo %d yhi %d, zlo %d, zhi %d\n", mpi.rank, mpi.xlo, mpi.xhi, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi);
   }
 
   /* Print runtime options */
   if (mpi.rank == 0) {
     printf("MPI processes: %d\n", mpi.nprocs);
-    printf("Effective mesh: %d x %d x %d\n", opt.nchunks*opt.chunklen, opt.gny, opt.gnz);
-    printf("  Cells: %ld\n", (long)opt.nchunks*opt.chunklen*opt.gny*opt.gnz);
-    printf("Decomposition: %d x %d\n", mpi.npey, mpi.npez);
+    printf("Effective mesh: %d x %d x %d\n", gnx, opt.gny, opt.gnz);
+    printf("  Cells: %ld\n", (long)gnx*opt.gny*opt.gnz);
+    printf("Decomposition: %d x %d x %d\n", mpi.npex, mpi.npey, mpi.npez);
+    printf("Nodes: %d\n", mpi.nnodes);
+    if (mpi.tile[0] > 0) printf("  Ranks per node: %d x %d x %d\n", mpi.tile[0], mpi.tile[1], mpi.tile[2]);
+    else printf("  Ranks per node: in rank order\n");
+    printf("  Off-node links: x %d/%d, y %d/%d, z %d/%d\n",
+      mpi.offnode[0], mpi.links[0], mpi.offnode[1], mpi.links[1], mpi.offnode[2], mpi.links[2]);
     printf("Subdomain: %d x %d x %d\n", opt.nchunks*opt.chunklen, opt.ny, opt.nz);
     printf("Chunks per octant: %d\n", opt.nchunks);
     printf("Cells per chunk: %d\n", opt.chunklen);
     printf("Number of angles: %d\n", opt.nang);
     printf("Number of energy groups: %d\n", opt.ng);
     printf("Numer of sweeps: %d\n", opt.nsweeps);
+    printf("Octant order: %s\n", (opt.octants == PIPELINED_OCTANTS) ? "pipelined" : "ordered");
+    if (opt.persistent) printf("Persistent requests: on\n");
+    if (opt.precision == FP32_WIRE) printf("Face precision on the wire: fp32\n");
+    else if (opt.precision == BF16_WIRE) printf("Face precision on the wire: bf16\n");
+    if (opt.pack == DATATYPE_PACK) printf("Face packing: derived datatypes from a flux array\n");
+    else if (opt.pack == MANUAL_PACK) printf("Face packing: by hand from a flux array\n");
+    if (sweepers[opt.version].group_match) {
+      if (opt.match == TAG_MATCH) printf("Message matching: tag per group\n");
+      else if (opt.match == COMM_MATCH) printf("Message matching: communicator per group\n");
+      else printf("Message matching: communicator per group, no wildcards\n");
+    }
+    if (opt.kernel == FLOPS) printf("Kernel: flops\n");
+    else if (opt.kernel == TRIAD) printf("Kernel: triad\n");
+    else if (opt.kernel == STENCIL) printf("Kernel: stencil\n");
+    else if (opt.kernel == TRANSPORT) printf("Kernel: transport\n");
+    if (opt.kernel != TRANSPORT) printf("Work per angle per cell: %d\n", opt.work);
+    if (opt.wset > 0) printf("Working set per thread: %d KiB\n", opt.wset);
+    if (opt.kernel == TRANSPORT) printf("Flux layout: %s\n", (opt.layout == ANGLE_LAYOUT) ? "angle" : "group");
     printf("====================\n");
-    if (opt.version == SERIAL) printf("Running serial sweeper\n");
-    else if (opt.version == PARGROUP) printf("Running parallel group sweeper\n");
-    else if (opt.version == PARMPI) printf("Running parallel MPI sweeper\n");
-    else if (opt.version == MULTILOCK) printf("Running parallel MPI sweeper (multiple locks)\n");
-    else if (opt.version == ONESIDED) printf("Running one sided sweeper\n");
+    if (sweepers[opt.version].describe) sweepers[opt.version].describe(opt);
+    else printf("Running %s\n", sweepers[opt.version].title);
+    printf("\n");
+  }
+
+  /* Communicators for each group's messages, when matched that way */
+  init_group_comms(&mpi, opt);
+
+  /* Set up the per-cell work, outside of any sweep timings */
+  init_compute(mpi, opt);
+  if (mpi.rank == 0 && (opt.kernel == FLOPS || opt.kernel == TRANSPORT)) {
+    printf("Using %s kernel\n", compute_specialised(opt) ? "specialised" : "generic");
     printf("\n");
   }
 
+  /* Pick the bundle size from the model, before anything is swept */
+  if (opt.version == BUNDLED && opt.groups_per_msg == 0) {
+    opt.groups_per_msg = model_groups_per_msg(mpi, opt, measure_model(mpi, opt));
+    if (mpi.rank == 0) {
+      printf("Groups per message: %d\n", opt.groups_per_msg);
+      printf("\n");
+    }
+  }
+
+  /* Pick the chunking before the timed sweeps */
+  if (opt.autotune) {
+    autotune(mpi, &opt, run_sweep);
+  }
+
+  /* Build the state the sweeper keeps between sweeps, once the chunking is known */
+  const sweeper_desc *sw = &sweepers[opt.version];
+  if (sw->init) {
+    double setup = MPI_Wtime();
+    sw->init(mpi, opt);
+    setup = MPI_Wtime() - setup;
+    if (mpi.rank == 0) {
+      printf("Sweeper state built in %.6lf s, and kept for all sweeps\n", setup);
+      printf("\n");
+    }
+  }
+
+  /* Measure the network and compute costs for the performance model */
+  perfmodel model = measure_model(mpi, opt);
+
   timings *times = malloc(opt.nsweeps*sizeof(timings));
 
   /* Run the benchmark multiple times */
   for (int s = 0; s < opt.nsweeps; s++) {
 
-    if (opt.version == SERIAL)
-      times[s] = serial_sweep(mpi, opt);
-    else if (opt.version == PARGROUP)
-      times[s] = par_group_sweep(mpi, opt);
-    else if (opt.version == PARMPI)
-      times[s] = par_mpi_sweep(mpi, opt);
-    else if (opt.version == MULTILOCK)
-      times[s] = par_mpi_multi_lock_sweep(mpi, opt);
-    else if (opt.version == ONESIDED)
-      times[s] = one_sided_sweep(mpi, opt);
+    reset_compute(opt);
+    times[s] = run_sweep(mpi, opt);
   }
 
   if (mpi.rank == 0) {
     print_timings(opt, times);
   }
 
+  /* Compare against the model */
+  print_model(mpi, opt, model, times, sw->threaded, sw->msgs(opt));
+
+  /* Bytes moved, and what packing them to --precision cost and saved */
+  if (sw->wire) {
+    print_wire(mpi, opt, model, times);
+  }
+
+  /* Report a checksum of the last sweep's solution so sweepers can be compared */
+  if (opt.kernel == TRANSPORT) {
+    double local = compute_checksum(opt);
+    double total;
+    MPI_Reduce(&local, &total, 1, MPI_DOUBLE, MPI_SUM, 0, mpi.comm);
+    if (mpi.rank == 0) {
+      printf("Scalar flux checksum: %.12e\n", total);
+      printf("\n");
+    }
+  }
+
   free(times);
+  end_compute(opt);
+  if (sw->end) sw->end();
+  end_group_comms(&mpi, opt);
 
+  MPI_Comm_free(&mpi.comm);
   MPI_Finalize();
 
 }
 
+/* Run one sweep with the selected sweeper */
+timings run_sweep(mpistate mpi, options opt) {
+  return sweepers[opt.version].run(mpi, opt);
+}
+
 void print_timings(options opt, timings *times) {
   double total = 0.0;
   int min = 0;
@@ -160,6 +265,8 @@ void print_timings(options opt, timings *times) {
   printf("      Setup:     %11.6lf s\n", times[min].setup);
   printf("      Sweeping:  %11.6lf s\n", times[min].sweeping);
   printf("        Comms:   %11.6lf s (%.1lf%%)\n", times[min].comms, times[min].comms/times[min].sweeping*100.0);
+  if (opt.pack == DATATYPE_PACK) printf("          Packing:   inside MPI\n");
+  else if (times[min].packing > 0.0) printf("          Packing: %11.6lf s\n", times[min].packing);
   double compute = times[min].sweeping-times[min].comms;
   printf("        Compute: %11.6lf s (%.1lf%%)\n", compute, compute/times[min].sweeping*100.0);
   printf("====================\n");
@@ -189,6 +296,12 @@ void parse_args(mpistate mpi, int argc, char *argv[], options *opt) {
     else if (strcmp(argv[i], "--strong") == 0) {
       opt->strong = 1;
     }
+    else if (strcmp(argv[i], "--autotune") == 0) {
+      opt->autotune = 1;
+    }
+    else if (strcmp(argv[i], "--persistent") == 0) {
+      opt->persistent = 1;
+    }
     else if (strcmp(argv[i], "--nang") == 0) {
       opt->nang = atoi(argv[++i]);
     }
@@ -197,28 +310,182 @@ void parse_args(mpistate mpi, int argc, char *argv[], options *opt) {
     }
     else if (strcmp(argv[i], "--sweep") == 0) {
       i++;
-      if (strcmp(argv[i], "serial") == 0) {
-        opt->version = SERIAL;
+      const sweeper_desc *sw = find_sweeper(argv[i]);
+      if (sw) {
+        opt->version = sw - sweepers;
+      }
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown sweep type: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--octants") == 0) {
+      i++;
+      if (strcmp(argv[i], "ordered") == 0) {
+        opt->octants = ORDERED_OCTANTS;
+      }
+      else if (strcmp(argv[i], "pipelined") == 0) {
+        opt->octants = PIPELINED_OCTANTS;
+      }
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown octant order: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--placement") == 0) {
+      i++;
+      if (strcmp(argv[i], "node") == 0) {
+        opt->placement = NODE_PLACEMENT;
+      }
+      else if (strcmp(argv[i], "linear") == 0) {
+        opt->placement = LINEAR_PLACEMENT;
       }
-      else if (strcmp(argv[i], "pargroup") == 0) {
-        opt->version = PARGROUP;
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown placement: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
       }
-      else if (strcmp(argv[i], "parmpi") == 0) {
-        opt->version = PARMPI;
+    }
+    else if (strcmp(argv[i], "--match") == 0) {
+      i++;
+      if (strcmp(argv[i], "tag") == 0) {
+        opt->match = TAG_MATCH;
       }
-      else if (strcmp(argv[i], "multilock") == 0) {
-        opt->version = MULTILOCK;
+      else if (strcmp(argv[i], "comm") == 0) {
+        opt->match = COMM_MATCH;
       }
-      else if (strcmp(argv[i], "onesided") == 0) {
-        opt->version = ONESIDED;
+      else if (strcmp(argv[i], "hints") == 0) {
+        opt->match = HINTED_MATCH;
       }
       else {
         if (mpi.rank == 0) {
-        printf("Unknown sweep type: %s\n", argv[i]);
+        printf("Unknown matching: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--precision") == 0) {
+      i++;
+      if (strcmp(argv[i], "fp64") == 0) {
+        opt->precision = FP64_WIRE;
+      }
+      else if (strcmp(argv[i], "fp32") == 0) {
+        opt->precision = FP32_WIRE;
+      }
+      else if (strcmp(argv[i], "bf16") == 0) {
+        opt->precision = BF16_WIRE;
+      }
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown precision: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--pack") == 0) {
+      i++;
+      if (strcmp(argv[i], "datatype") == 0) {
+        opt->pack = DATATYPE_PACK;
+      }
+      else if (strcmp(argv[i], "manual") == 0) {
+        opt->pack = MANUAL_PACK;
+      }
+      else if (strcmp(argv[i], "contiguous") == 0) {
+        opt->pack = CONTIGUOUS_PACK;
+      }
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown packing: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--priority") == 0) {
+      i++;
+      if (strcmp(argv[i], "depth") == 0) {
+        opt->priority = DEPTH_PRIORITY;
+      }
+      else if (strcmp(argv[i], "early") == 0) {
+        opt->priority = EARLY_PRIORITY;
+      }
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown priority: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--kernel") == 0) {
+      i++;
+      if (strcmp(argv[i], "flops") == 0) {
+        opt->kernel = FLOPS;
+      }
+      else if (strcmp(argv[i], "triad") == 0) {
+        opt->kernel = TRIAD;
+      }
+      else if (strcmp(argv[i], "stencil") == 0) {
+        opt->kernel = STENCIL;
+      }
+      else if (strcmp(argv[i], "transport") == 0) {
+        opt->kernel = TRANSPORT;
+      }
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown kernel: %s\n", argv[i]);
         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
         }
       }
     }
+    else if (strcmp(argv[i], "--work") == 0) {
+      opt->work = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--wset") == 0) {
+      opt->wset = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--layout") == 0) {
+      i++;
+      if (strcmp(argv[i], "angle") == 0) {
+        opt->layout = ANGLE_LAYOUT;
+      }
+      else if (strcmp(argv[i], "group") == 0) {
+        opt->layout = GROUP_LAYOUT;
+      }
+      else {
+        if (mpi.rank == 0) {
+        printf("Unknown layout: %s\n", argv[i]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--nbufs") == 0) {
+      opt->nbufs = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--groups-per-msg") == 0) {
+      i++;
+      if (strcmp(argv[i], "auto") == 0) {
+        opt->groups_per_msg = 0;
+      }
+      else {
+        opt->groups_per_msg = atoi(argv[i]);
+        if (opt->groups_per_msg < 1) {
+          if (mpi.rank == 0) {
+          printf("Unknown groups per message: %s\n", argv[i]);
+          MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+          }
+        }
+      }
+    }
+    else if (strcmp(argv[i], "--angle-sets") == 0) {
+      opt->angle_sets = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--npex") == 0) {
+      opt->npex = atoi(argv[++i]);
+    }
     else if (strcmp(argv[i], "--nsweeps") == 0) {
       opt->nsweeps = atoi(argv[++i]);
     }
@@ -232,10 +499,30 @@ void parse_args(mpistate mpi, int argc, char *argv[], options *opt) {
         printf("\t--nz       N\tNumber of cells per subdomain in z-dimension\n");
         printf("\t--meshny   N\tNumber of cells in y-dimension - not compatible with ny option\n");
         printf("\t--meshnz   N\tNumber of cells in z-dimension - not compatible with nz option\n");
+        printf("\t--npex     N\tNumber of ranks in x-dimension, for a 3D decomposition\n");
+        printf("\t--placement type\tRank placement. Options: node, linear\n");
         printf("\t--strong    \tSpecify running strong scaling\n");
+        printf("\t--autotune  \tSearch for the fastest split of the x extent into chunks before sweeping\n");
+        printf("\t--persistent\tUse persistent requests in the serial and parmpi sweepers\n");
+        printf("\t--match type\tMatch each group's messages in the parmpi, multilock and funneled sweepers by tag or by communicator. Options: tag, comm, hints\n");
+        printf("\t--precision type\tPrecision of the y and z faces on the wire in the pargroup, bundled and anglesets sweepers. Options: fp64, fp32, bf16\n");
+        printf("\t--pack type\tWhere the pargroup sweeper keeps the y and z faces, and how it packs them. The flux arrays stand in for a code's cell data, and are not the transport kernel's angular flux. Options: datatype, manual, contiguous\n");
         printf("\t--nang     N\tNumber of angles per cell\n");
+        printf("\t--angle-sets N\tSplit the angles of each octant into N sets, pipelined separately by the anglesets sweeper\n");
         printf("\t--ng       N\tNumber of energy groups\n");
-        printf("\t--sweep type\tSweeper to run. Options: serial, pargroup, parmpi, multilock, onesided\n");
+        printf("\t--sweep type\tSweeper to run. Options:");
+        for (int s = 0; s < NSWEEPERS; s++) {
+          printf("%s %s", (s > 0) ? "," : "", sweepers[s].name);
+        }
+        printf("\n");
+        printf("\t--octants type\tOctant order. Options: ordered, pipelined\n");
+        printf("\t--nbufs    N\tReceives posted ahead by the prepost sweeper\n");
+        printf("\t--groups-per-msg N\tGroups in each message of the bundled sweeper, or auto to choose from the performance model\n");
+        printf("\t--priority type\tFront priority for the multicorner sweeper. Options: depth, early\n");
+        printf("\t--kernel type\tWork per cell. Options: flops, triad, stencil, transport\n");
+        printf("\t--work    N\tWork per angle per cell for the flops, triad and stencil kernels\n");
+        printf("\t--wset    N\tWorking set per thread in KiB for the triad and stencil kernels\n");
+        printf("\t--layout type\tFlux layout for the transport kernel. Options: angle, group\n");
       }
       /* Exit nicely */
       MPI_Finalize();
@@ -256,5 +543,69 @@ void parse_args(mpistate mpi, int argc, char *argv[], options *opt) {
       MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
   }
+  if (opt->angle_sets < 1 || opt->angle_sets > opt->nang) {
+    if (mpi.rank == 0) {
+      printf("Number of angle sets must be between 1 and --nang\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->npex < 1 || mpi.nprocs % opt->npex) {
+    if (mpi.rank == 0) {
+      printf("Number of ranks must be a multiple of --npex\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->strong && opt->nchunks < opt->npex) {
+    if (mpi.rank == 0) {
+      printf("Must have at least one chunk per rank in x with --strong option\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->strong && opt->autotune && opt->nchunks % opt->npex) {
+    if (mpi.rank == 0) {
+      printf("Must split --nchunks evenly over --npex ranks to use --autotune with --strong option\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->nbufs < 1) {
+    if (mpi.rank == 0) {
+      printf("Must post at least one buffer ahead with --nbufs\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->persistent && !sweepers[opt->version].persistent) {
+    if (mpi.rank == 0) {
+      printf("Persistent requests with --persistent are only supported by the serial and parmpi sweepers\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->precision != FP64_WIRE && !sweepers[opt->version].wire) {
+    if (mpi.rank == 0) {
+      printf("Reduced --precision is only supported by the pargroup, bundled and anglesets sweepers\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->pack != CONTIGUOUS_PACK && !sweepers[opt->version].flux_array) {
+    if (mpi.rank == 0) {
+      printf("Faces in a flux array with --pack are only supported by the pargroup sweeper\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->pack != CONTIGUOUS_PACK && opt->precision != FP64_WIRE) {
+    if (mpi.rank == 0) {
+      printf("Reduced --precision needs --pack contiguous\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  if (opt->match == TAG_MATCH && sweepers[opt->version].group_match) {
+    int *tagub, flag;
+    MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tagub, &flag);
+    if (!flag || 8L*opt->ng - 1 > *tagub) {
+      if (mpi.rank == 0) {
+        printf("Too many groups to tag each group's messages - use --match comm\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+    }
+  }
 }
 
@@ -23,8 +23,27 @@
 #include <stdlib.h>
 #include "sweep.h"
 
-void init_serial_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf);
-void end_serial_sweep(double *ybuf, double *zbuf);
+void init_serial_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf);
+void end_serial_sweep(double **ybuf, double **zbuf, double *xbuf);
+
+/*
+ * Message buffers kept between sweeps, along with the persistent
+ * requests bound to them with --persistent. They are kept until the
+ * face sizes or --persistent change.
+ * Requests are indexed by direction, where 0 is stepping backwards, and
+ * then by buffer.
+ */
+typedef struct serial_context {
+  int ycount, zcount, xcount;
+  int persistent;
+  double *ybuf[2];
+  double *zbuf[2];
+  double *xbuf;
+  MPI_Request yrecv[2][2], zrecv[2][2], xrecv[2];
+  MPI_Request ysend[2][2], zsend[2][2], xsend[2];
+} serial_context;
+
+static serial_context *context = NULL;
 
 /* Perform a vanilla KBA sweep without using OpenMP threads */
 timings serial_sweep(mpistate mpi, options opt) {
@@ -35,100 +54,215 @@ timings serial_sweep(mpistate mpi, options opt) {
     .comms = 0.0
   };
 
-  /* Message buffers */
-  time.setup = MPI_Wtime();
-  const int ycount = opt.nang * opt.nz * opt.chunklen;
-  const int zcount = opt.nang * opt.ny * opt.chunklen;
-  double *ybuf;
-  double *zbuf;
-  init_serial_sweep(ycount, zcount, &ybuf, &zbuf);
-  time.setup = MPI_Wtime() - time.setup;
+  /*
+   * Message buffers - two of each so that a receive never lands in
+   * a buffer which is still being sent from, and one for the x face
+   */
+  init_serial_context(mpi, opt);
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double *xbuf = context->xbuf;
+  int buf = 0;
 
-  /* Send requests */
-  MPI_Request req[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+  /* Send requests - y, z and x */
+  MPI_Request req[3] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL, MPI_REQUEST_NULL};
 
   /* Start the timer */
   double tick = MPI_Wtime();
 
-  /* Octant loops - 0 is stepping backwards, 1 is stepping forwards */
-  for (int k = 0; k < 2; k++) {
-    for (int j = 0; j < 2; j++) {
-      for (int i = 0; i < 2; i++) {
-
-        /* Loop over energy groups in serial */
-        for (int g = 0; g < opt.ng; g++) {
-
-          /* Loop over messages to send per octant */
-          for (int c = 0; c < opt.nchunks; c++) {
-
-            /* Receive payload from upwind neighbours */
-            double comtime = MPI_Wtime();
-            if (j == 0) {
-              MPI_Recv(ybuf, ycount, MPI_DOUBLE, mpi.yhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            else {
-              MPI_Recv(ybuf, ycount, MPI_DOUBLE, mpi.ylo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-
-            if (k == 0) {
-              MPI_Recv(zbuf, zcount, MPI_DOUBLE, mpi.zhi, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            else {
-              MPI_Recv(zbuf, zcount, MPI_DOUBLE, mpi.zlo, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            time.comms += MPI_Wtime() - comtime;
-
-            /* Do proportional "work" */
-            for (int w = 0; w < opt.nang*opt.chunklen*opt.ny*opt.nz; w++) {
-              compute();
-            }
-
-            /* Send payload to downwind neighbours */
-            comtime = MPI_Wtime();
-            MPI_Waitall(2, req, MPI_STATUS_IGNORE);
-
-            if (j == 0) {
-              MPI_Isend(ybuf, ycount, MPI_DOUBLE, mpi.ylo, 0, MPI_COMM_WORLD, req+0);
-            }
-            else {
-              MPI_Isend(ybuf, ycount, MPI_DOUBLE, mpi.yhi, 0, MPI_COMM_WORLD, req+0);
-            }
-
-            if (k == 0) {
-              MPI_Isend(zbuf, zcount, MPI_DOUBLE, mpi.zlo, 0, MPI_COMM_WORLD, req+1);
-            }
-            else {
-              MPI_Isend(zbuf, zcount, MPI_DOUBLE, mpi.zhi, 0, MPI_COMM_WORLD, req+1);
-            }
-            time.comms += MPI_Wtime() - comtime;
-
-          } /* End nchunks loop */
-        } /* End ng loop */
-      } /* End i loop */
-    } /* End j loop */
-  } /* End k loop */
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Loop over energy groups in serial */
+    for (int g = 0; g < opt.ng; g++) {
+
+      /* Loop over messages to send per octant */
+      for (int c = 0; c < opt.nchunks; c++) {
+
+        /* Receive payload from upwind neighbours, starting with the x face on the first chunk */
+        double comtime = MPI_Wtime();
+        if (c == 0) {
+          MPI_Wait(req+2, MPI_STATUS_IGNORE);
+          if (opt.persistent) {
+            MPI_Start(&context->xrecv[i]);
+            MPI_Wait(&context->xrecv[i], MPI_STATUS_IGNORE);
+          }
+          else if (i == 0) {
+            MPI_Recv(xbuf, xcount, MPI_DOUBLE, mpi.xhi, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+          }
+          else {
+            MPI_Recv(xbuf, xcount, MPI_DOUBLE, mpi.xlo, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+          }
+        }
+
+        if (opt.persistent) {
+          MPI_Request recv[2] = {context->yrecv[j][buf], context->zrecv[k][buf]};
+          MPI_Startall(2, recv);
+          MPI_Waitall(2, recv, MPI_STATUSES_IGNORE);
+        }
+        else {
+          if (j == 0) {
+            MPI_Recv(ybuf[buf], ycount, MPI_DOUBLE, mpi.yhi, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+          }
+          else {
+            MPI_Recv(ybuf[buf], ycount, MPI_DOUBLE, mpi.ylo, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+          }
+
+          if (k == 0) {
+            MPI_Recv(zbuf[buf], zcount, MPI_DOUBLE, mpi.zhi, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+          }
+          else {
+            MPI_Recv(zbuf[buf], zcount, MPI_DOUBLE, mpi.zlo, MPI_ANY_TAG, mpi.comm, MPI_STATUS_IGNORE);
+          }
+        }
+        time.comms += MPI_Wtime() - comtime;
+
+        /* Do proportional "work" */
+        compute_chunk(opt, oct, c, g, 0, 1, ybuf[buf], zbuf[buf], xbuf);
+
+        /* Send payload to downwind neighbours */
+        comtime = MPI_Wtime();
+        MPI_Waitall(2, req, MPI_STATUS_IGNORE);
+
+        if (opt.persistent) {
+          req[0] = context->ysend[j][buf];
+          req[1] = context->zsend[k][buf];
+          MPI_Startall(2, req);
+        }
+        else {
+          if (j == 0) {
+            MPI_Isend(ybuf[buf], ycount, MPI_DOUBLE, mpi.ylo, 0, mpi.comm, req+0);
+          }
+          else {
+            MPI_Isend(ybuf[buf], ycount, MPI_DOUBLE, mpi.yhi, 0, mpi.comm, req+0);
+          }
+
+          if (k == 0) {
+            MPI_Isend(zbuf[buf], zcount, MPI_DOUBLE, mpi.zlo, 0, mpi.comm, req+1);
+          }
+          else {
+            MPI_Isend(zbuf[buf], zcount, MPI_DOUBLE, mpi.zhi, 0, mpi.comm, req+1);
+          }
+        }
+
+        /* The x face leaves after the last chunk */
+        if (c == opt.nchunks-1) {
+          if (opt.persistent) {
+            req[2] = context->xsend[i];
+            MPI_Start(req+2);
+          }
+          else if (i == 0) {
+            MPI_Isend(xbuf, xcount, MPI_DOUBLE, mpi.xlo, 0, mpi.comm, req+2);
+          }
+          else {
+            MPI_Isend(xbuf, xcount, MPI_DOUBLE, mpi.xhi, 0, mpi.comm, req+2);
+          }
+        }
+        time.comms += MPI_Wtime() - comtime;
+
+        buf = 1 - buf;
+
+      } /* End nchunks loop */
+    } /* End ng loop */
+  } /* End octant loop */
+
+  /* Make sure the last faces have gone before the buffers are freed */
+  double comtime = MPI_Wtime();
+  MPI_Waitall(3, req, MPI_STATUS_IGNORE);
+  time.comms += MPI_Wtime() - comtime;
 
   /* End the timer */
   double tock = MPI_Wtime();
 
   time.sweeping = tock-tick;
 
-  end_serial_sweep(ybuf, zbuf);
-
   time.setup += MPI_Wtime() - tock;
 
   return time;
 }
 
 /* Allocate MPI message buffers */
-void init_serial_sweep(const int ycount, const int zcount, double **ybuf, double **zbuf) {
-  (*ybuf) = malloc(sizeof(double)*ycount);
-  (*zbuf) = malloc(sizeof(double)*zcount);
+void init_serial_sweep(const int ycount, const int zcount, const int xcount, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < 2; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  *xbuf = malloc(sizeof(double)*xcount);
 }
 
 /* Free MPI message buffers */
-void end_serial_sweep(double *ybuf, double *zbuf) {
-  free(ybuf);
-  free(zbuf);
+void end_serial_sweep(double **ybuf, double **zbuf, double *xbuf) {
+  for (int b = 0; b < 2; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  free(xbuf);
+}
+
+
+/*
+ * Build the buffers, and the persistent requests with --persistent,
+ * unless those from an earlier sweep are still right.
+ * The receive for a direction comes from the hi neighbour when stepping
+ * backwards, and the send goes to the lo neighbour.
+ */
+void init_serial_context(mpistate mpi, options opt) {
+  const int ycount = opt.nang * opt.nz * opt.chunklen;
+  const int zcount = opt.nang * opt.ny * opt.chunklen;
+  const int xcount = opt.nang * opt.ny * opt.nz;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->persistent == opt.persistent) return;
+    end_serial_context();
+  }
+
+  context = malloc(sizeof(serial_context));
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->persistent = opt.persistent;
+  init_serial_sweep(ycount, zcount, xcount, context->ybuf, context->zbuf, &context->xbuf);
+  if (!opt.persistent) return;
+
+  const int xup[2] = {mpi.xhi, mpi.xlo};
+  const int yup[2] = {mpi.yhi, mpi.ylo};
+  const int zup[2] = {mpi.zhi, mpi.zlo};
+  for (int d = 0; d < 2; d++) {
+    for (int b = 0; b < 2; b++) {
+      MPI_Recv_init(context->ybuf[b], ycount, MPI_DOUBLE, yup[d], MPI_ANY_TAG, mpi.comm, &context->yrecv[d][b]);
+      MPI_Recv_init(context->zbuf[b], zcount, MPI_DOUBLE, zup[d], MPI_ANY_TAG, mpi.comm, &context->zrecv[d][b]);
+      MPI_Send_init(context->ybuf[b], ycount, MPI_DOUBLE, yup[1-d], 0, mpi.comm, &context->ysend[d][b]);
+      MPI_Send_init(context->zbuf[b], zcount, MPI_DOUBLE, zup[1-d], 0, mpi.comm, &context->zsend[d][b]);
+    }
+    MPI_Recv_init(context->xbuf, xcount, MPI_DOUBLE, xup[d], MPI_ANY_TAG, mpi.comm, &context->xrecv[d]);
+    MPI_Send_init(context->xbuf, xcount, MPI_DOUBLE, xup[1-d], 0, mpi.comm, &context->xsend[d]);
+  }
 }
 
+/* Free the buffers, and the persistent requests */
+void end_serial_context(void) {
+  if (!context) return;
+
+  for (int d = 0; d < 2 && context->persistent; d++) {
+    for (int b = 0; b < 2; b++) {
+      MPI_Request_free(&context->yrecv[d][b]);
+      MPI_Request_free(&context->zrecv[d][b]);
+      MPI_Request_free(&context->ysend[d][b]);
+      MPI_Request_free(&context->zsend[d][b]);
+    }
+    MPI_Request_free(&context->xrecv[d]);
+    MPI_Request_free(&context->xsend[d]);
+  }
+  end_serial_sweep(context->ybuf, context->zbuf, context->xbuf);
+  free(context);
+  context = NULL;
+}
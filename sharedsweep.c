@@ -0,0 +1,441 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include "options.h"
+#include <stdlib.h>
+#include "sweep.h"
+
+/* Neighbours in the order of mpistate, lo then hi for each dimension */
+enum shared_neighbour {SHARED_XLO, SHARED_XHI, SHARED_YLO, SHARED_YHI, SHARED_ZLO, SHARED_ZHI, SHARED_NNBRS};
+
+/*
+ * Offsets of the flags in each rank's part of the flag window, for S slots:
+ *   whether each of the rank's own face slots is free,
+ *   the faces handed over by each neighbour and taken by this rank,
+ *   and a mailbox of the owner and slot of each face handed over.
+ */
+#define FREE_FLAG(S, d, s) ((d)*(S) + (s))
+#define ARRIVED_FLAG(S, n) (3*(S) + (n))
+#define TAKEN_FLAG(S, n) (3*(S) + SHARED_NNBRS + (n))
+#define MAILBOX_FLAG(S, n, e) (3*(S) + 2*SHARED_NNBRS + 2*((n)*(S) + (e)))
+#define NFLAGS(S) (3*(S) + 2*SHARED_NNBRS + 2*SHARED_NNBRS*(S))
+
+typedef struct shared_state {
+  /* Ranks sharing memory with this one */
+  MPI_Comm nodecomm;
+  int noderank, nodesize;
+
+  /* Neighbours in mpi.comm, and in nodecomm or -1 when not on this node */
+  int nbrs[SHARED_NNBRS];
+  int nodenbrs[SHARED_NNBRS];
+
+  /* Face slots for each dimension, and where every rank on the node keeps them */
+  int slots;
+  int count[3];
+  MPI_Win facewin[3];
+  double **face[3];
+
+  /* Flags, and where every rank on the node keeps them */
+  MPI_Win flagwin;
+  int **flags;
+
+  /* Next of this rank's own slots to use, and faces handed over to and taken from each neighbour */
+  int nextslot[3];
+  int nhanded[SHARED_NNBRS];
+  int ntaken[SHARED_NNBRS];
+
+  /* Faces being sent off the node, with the slots to free when they have gone */
+  MPI_Request *sendreq[3];
+  int *sendowner[3];
+  int *sendslot[3];
+  int nsends[3];
+} shared_state;
+
+/* Windows and flags kept between sweeps until the face sizes change */
+static shared_state *context = NULL;
+
+void init_shared_sweep(mpistate mpi, options opt, shared_state *st);
+void end_shared_sweep(shared_state *st);
+double *acquire_face(mpistate mpi, shared_state *st, int n, int *owner, int *slot);
+void pass_face(mpistate mpi, shared_state *st, int n, double *face, int owner, int slot);
+void release_slot(shared_state *st, int d, int owner, int slot);
+void shared_progress(shared_state *st);
+void wait_sent(shared_state *st, int d, int e);
+void wait_request(shared_state *st, MPI_Request *req);
+void wait_flag(shared_state *st, int *flag, int target);
+int read_flag(int *flag);
+
+/*
+ * Perform a KBA sweep threading over groups inside the chunk, passing
+ * faces between ranks on the same node through shared memory.
+ *
+ * Every face lives in a slot of an MPI_Win_allocate_shared window,
+ * owned by the rank which first received it from off the node, or
+ * which started it on the edge of the domain. Downwind ranks on the
+ * same node compute on the face in place in the owner's slot, and then
+ * hand it on again, so a face is never copied while it stays on the
+ * node. Handing over a face writes the owner and slot into the
+ * downwind rank's mailbox and then bumps its arrived counter. The last
+ * rank on the node sends the face on with MPI_Isend, and the slot goes
+ * back to its owner once the send has completed.
+ * All the flags are plain integers in a second shared window, read and
+ * written atomically, with MPI_Win_sync ordering them with the faces.
+ * The windows are kept between sweeps, and the counters carry on from
+ * one sweep to the next.
+ */
+timings shared_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  init_shared_context(mpi, opt);
+  shared_state *st = context;
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+  /* Octant loop, in the order selected with --octants */
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    /* Upwind neighbours - stepping backwards the faces come from the hi side */
+    const int xup = (i == 0) ? SHARED_XHI : SHARED_XLO;
+    const int yup = (j == 0) ? SHARED_YHI : SHARED_YLO;
+    const int zup = (k == 0) ? SHARED_ZHI : SHARED_ZLO;
+
+    /* The x face is held through the chunks of the octant */
+    int xowner, xslot;
+    double comtime = MPI_Wtime();
+    double *xbuf = acquire_face(mpi, st, xup, &xowner, &xslot);
+    time.comms += MPI_Wtime() - comtime;
+
+    /* Loop over messages to send per octant */
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      /* Receive payload from upwind neighbours */
+      int yowner, yslot, zowner, zslot;
+      comtime = MPI_Wtime();
+      double *ybuf = acquire_face(mpi, st, yup, &yowner, &yslot);
+      double *zbuf = acquire_face(mpi, st, zup, &zowner, &zslot);
+      time.comms += MPI_Wtime() - comtime;
+
+      #pragma omp parallel for
+      for (int g = 0; g < opt.ng; g++) {
+
+        /* Do proportional "work" */
+        compute_chunk(opt, oct, c, g, g, opt.ng, ybuf, zbuf, xbuf);
+
+      } /* End group loop */
+
+      /* Send payload to downwind neighbours */
+      comtime = MPI_Wtime();
+      pass_face(mpi, st, yup^1, ybuf, yowner, yslot);
+      pass_face(mpi, st, zup^1, zbuf, zowner, zslot);
+
+      /* The x face leaves after the last chunk */
+      if (c == opt.nchunks-1) {
+        pass_face(mpi, st, xup^1, xbuf, xowner, xslot);
+      }
+      time.comms += MPI_Wtime() - comtime;
+
+    } /* End nchunks loop */
+  } /* End octant loop */
+
+  /* Make sure the last faces have gone, and their slots are given back */
+  double comtime = MPI_Wtime();
+  for (int d = 0; d < 3; d++) {
+    for (int e = 0; e < st->slots; e++) {
+      wait_sent(st, d, e);
+    }
+  }
+  time.comms += MPI_Wtime() - comtime;
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+
+  return time;
+}
+
+/*
+ * Get the next face from neighbour n, and the slot it is in.
+ * From a neighbour on the node the face is taken from the mailbox. Otherwise
+ * it goes in this rank's next free slot, received from the neighbour if there
+ * is one, or only holding the outgoing face on the edge of the domain.
+ */
+double *acquire_face(mpistate mpi, shared_state *st, int n, int *owner, int *slot) {
+  const int d = n / 2;
+  const int S = st->slots;
+  int *flags = st->flags[st->noderank];
+
+  if (st->nodenbrs[n] >= 0) {
+    const int seq = st->ntaken[n]++;
+    wait_flag(st, flags + ARRIVED_FLAG(S, n), seq + 1);
+    MPI_Win_sync(st->flagwin);
+    MPI_Win_sync(st->facewin[d]);
+    *owner = flags[MAILBOX_FLAG(S, n, seq%S)];
+    *slot = flags[MAILBOX_FLAG(S, n, seq%S) + 1];
+    #pragma omp atomic write seq_cst
+    flags[TAKEN_FLAG(S, n)] = seq + 1;
+  }
+  else {
+    *owner = st->noderank;
+    *slot = st->nextslot[d];
+    st->nextslot[d] = (*slot + 1) % S;
+    wait_flag(st, flags + FREE_FLAG(S, d, *slot), 1);
+    #pragma omp atomic write seq_cst
+    flags[FREE_FLAG(S, d, *slot)] = 0;
+  }
+
+  double *face = st->face[d][*owner] + (long)(*slot) * st->count[d];
+
+  if (st->nodenbrs[n] < 0 && st->nbrs[n] != MPI_PROC_NULL) {
+    MPI_Request req;
+    MPI_Irecv(face, st->count[d], MPI_DOUBLE, st->nbrs[n], d, mpi.comm, &req);
+    wait_request(st, &req);
+  }
+
+  return face;
+}
+
+/*
+ * Pass a face on to neighbour n: hand it over on the node, send it off
+ * the node, or on the edge of the domain give the slot straight back.
+ */
+void pass_face(mpistate mpi, shared_state *st, int n, double *face, int owner, int slot) {
+  const int d = n / 2;
+  const int S = st->slots;
+
+  if (st->nodenbrs[n] >= 0) {
+    /* This rank is on the opposite side of the neighbour */
+    int *flags = st->flags[st->nodenbrs[n]];
+    const int seq = st->nhanded[n]++;
+    wait_flag(st, flags + TAKEN_FLAG(S, n^1), seq - S + 1);
+    MPI_Win_sync(st->facewin[d]);
+    flags[MAILBOX_FLAG(S, n^1, seq%S)] = owner;
+    flags[MAILBOX_FLAG(S, n^1, seq%S) + 1] = slot;
+    MPI_Win_sync(st->flagwin);
+    #pragma omp atomic write seq_cst
+    flags[ARRIVED_FLAG(S, n^1)] = seq + 1;
+  }
+  else if (st->nbrs[n] != MPI_PROC_NULL) {
+    const int e = st->nsends[d]++ % S;
+    wait_sent(st, d, e);
+    MPI_Isend(face, st->count[d], MPI_DOUBLE, st->nbrs[n], d, mpi.comm, st->sendreq[d] + e);
+    st->sendowner[d][e] = owner;
+    st->sendslot[d][e] = slot;
+  }
+  else {
+    release_slot(st, d, owner, slot);
+  }
+}
+
+/* Give a slot back to the rank which owns it */
+void release_slot(shared_state *st, int d, int owner, int slot) {
+  MPI_Win_sync(st->facewin[d]);
+  #pragma omp atomic write seq_cst
+  st->flags[owner][FREE_FLAG(st->slots, d, slot)] = 1;
+}
+
+/* Give back the slots of any sends off the node which have completed */
+void shared_progress(shared_state *st) {
+  for (int d = 0; d < 3; d++) {
+    for (int e = 0; e < st->slots; e++) {
+      if (st->sendreq[d][e] == MPI_REQUEST_NULL) continue;
+      int done;
+      MPI_Test(st->sendreq[d] + e, &done, MPI_STATUS_IGNORE);
+      if (done) release_slot(st, d, st->sendowner[d][e], st->sendslot[d][e]);
+    }
+  }
+}
+
+/* Wait for a send off the node to complete and its slot to be given back */
+void wait_sent(shared_state *st, int d, int e) {
+  while (st->sendreq[d][e] != MPI_REQUEST_NULL) {
+    shared_progress(st);
+  }
+}
+
+/*
+ * Wait for a receive, giving back slots as sends complete so that no
+ * rank on the node waits on this one for a free slot.
+ */
+void wait_request(shared_state *st, MPI_Request *req) {
+  int done = 0;
+  while (1) {
+    MPI_Test(req, &done, MPI_STATUS_IGNORE);
+    if (done) break;
+    shared_progress(st);
+  }
+}
+
+/* Spin until a flag reaches target */
+void wait_flag(shared_state *st, int *flag, int target) {
+  while (read_flag(flag) < target) {
+    shared_progress(st);
+  }
+}
+
+int read_flag(int *flag) {
+  int value;
+  #pragma omp atomic read seq_cst
+  value = *flag;
+  return value;
+}
+
+/*
+ * Find the neighbours on this node, and allocate the shared windows.
+ * Faces travel in place across a node, so each rank has enough slots for
+ * a face to cross the longest line of ranks any node can hold.
+ */
+void init_shared_sweep(mpistate mpi, options opt, shared_state *st) {
+  MPI_Comm_split_type(mpi.comm, MPI_COMM_TYPE_SHARED, mpi.rank, MPI_INFO_NULL, &st->nodecomm);
+  MPI_Comm_rank(st->nodecomm, &st->noderank);
+  MPI_Comm_size(st->nodecomm, &st->nodesize);
+
+  int maxnode;
+  MPI_Allreduce(&st->nodesize, &maxnode, 1, MPI_INT, MPI_MAX, mpi.comm);
+  int longest = (mpi.npey > mpi.npez) ? mpi.npey : mpi.npez;
+  if (mpi.npex > longest) longest = mpi.npex;
+  st->slots = ((maxnode < longest) ? maxnode : longest) + 1;
+
+  /* Neighbours' ranks on this node */
+  const int nbrs[SHARED_NNBRS] = {mpi.xlo, mpi.xhi, mpi.ylo, mpi.yhi, mpi.zlo, mpi.zhi};
+  MPI_Group commgroup, nodegroup;
+  MPI_Comm_group(mpi.comm, &commgroup);
+  MPI_Comm_group(st->nodecomm, &nodegroup);
+  for (int n = 0; n < SHARED_NNBRS; n++) {
+    st->nbrs[n] = nbrs[n];
+    st->nodenbrs[n] = -1;
+    if (nbrs[n] == MPI_PROC_NULL) continue;
+    int noderank;
+    MPI_Group_translate_ranks(commgroup, 1, &nbrs[n], nodegroup, &noderank);
+    if (noderank != MPI_UNDEFINED) st->nodenbrs[n] = noderank;
+  }
+  MPI_Group_free(&commgroup);
+  MPI_Group_free(&nodegroup);
+
+  /* Face slots for each dimension */
+  st->count[0] = opt.nang * opt.ny * opt.nz * opt.ng;
+  st->count[1] = opt.nang * opt.nz * opt.chunklen * opt.ng;
+  st->count[2] = opt.nang * opt.ny * opt.chunklen * opt.ng;
+  for (int d = 0; d < 3; d++) {
+    double *base;
+    MPI_Win_allocate_shared(sizeof(double)*st->slots*st->count[d], sizeof(double), MPI_INFO_NULL, st->nodecomm, &base, &st->facewin[d]);
+    st->face[d] = malloc(sizeof(double *)*st->nodesize);
+    for (int r = 0; r < st->nodesize; r++) {
+      MPI_Aint size;
+      int disp;
+      MPI_Win_shared_query(st->facewin[d], r, &size, &disp, &st->face[d][r]);
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, st->facewin[d]);
+
+    st->nextslot[d] = 0;
+    st->nsends[d] = 0;
+    st->sendreq[d] = malloc(sizeof(MPI_Request)*st->slots);
+    st->sendowner[d] = malloc(sizeof(int)*st->slots);
+    st->sendslot[d] = malloc(sizeof(int)*st->slots);
+    for (int e = 0; e < st->slots; e++) {
+      st->sendreq[d][e] = MPI_REQUEST_NULL;
+    }
+  }
+
+  /* Flags - every slot starts free, and nothing has been handed over */
+  int *base;
+  MPI_Win_allocate_shared(sizeof(int)*NFLAGS(st->slots), sizeof(int), MPI_INFO_NULL, st->nodecomm, &base, &st->flagwin);
+  st->flags = malloc(sizeof(int *)*st->nodesize);
+  for (int r = 0; r < st->nodesize; r++) {
+    MPI_Aint size;
+    int disp;
+    MPI_Win_shared_query(st->flagwin, r, &size, &disp, &st->flags[r]);
+  }
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, st->flagwin);
+  for (int f = 0; f < NFLAGS(st->slots); f++) {
+    base[f] = 0;
+  }
+  for (int d = 0; d < 3; d++) {
+    for (int s = 0; s < st->slots; s++) {
+      base[FREE_FLAG(st->slots, d, s)] = 1;
+    }
+  }
+  for (int n = 0; n < SHARED_NNBRS; n++) {
+    st->nhanded[n] = 0;
+    st->ntaken[n] = 0;
+  }
+
+  /* Every flag must be set before any neighbour reads it */
+  MPI_Win_sync(st->flagwin);
+  MPI_Barrier(st->nodecomm);
+  MPI_Win_sync(st->flagwin);
+}
+
+/* Free the windows - collective over the node, so no rank frees a slot still in use */
+void end_shared_sweep(shared_state *st) {
+  for (int d = 0; d < 3; d++) {
+    MPI_Win_unlock_all(st->facewin[d]);
+    MPI_Win_free(&st->facewin[d]);
+    free(st->face[d]);
+    free(st->sendreq[d]);
+    free(st->sendowner[d]);
+    free(st->sendslot[d]);
+  }
+  MPI_Win_unlock_all(st->flagwin);
+  MPI_Win_free(&st->flagwin);
+  free(st->flags);
+  MPI_Comm_free(&st->nodecomm);
+}
+
+/*
+ * Build the windows and flags, unless those from an earlier sweep have
+ * the same face sizes. Collective over mpi.comm, as the node
+ * communicator is split from it.
+ */
+void init_shared_context(mpistate mpi, options opt) {
+  const int xcount = opt.nang * opt.ny * opt.nz * opt.ng;
+  const int ycount = opt.nang * opt.nz * opt.chunklen * opt.ng;
+  const int zcount = opt.nang * opt.ny * opt.chunklen * opt.ng;
+  if (context) {
+    if (context->count[0] == xcount && context->count[1] == ycount && context->count[2] == zcount) return;
+    end_shared_context();
+  }
+
+  context = malloc(sizeof(shared_state));
+  init_shared_sweep(mpi, opt, context);
+}
+
+/* Free the windows and flags */
+void end_shared_context(void) {
+  if (!context) return;
+
+  end_shared_sweep(context);
+  free(context);
+  context = NULL;
+}
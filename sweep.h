@@ -32,14 +32,102 @@ typedef struct timings {
   /* Total time spent sweeping, excluding setup */
   double sweeping;
 
-  /* Setup and tear down costs */
+  /* Setup and tear down costs of each sweep, not of the state kept between sweeps */
   double setup;
 
   /* Time in comms */
   double comms;
 
+  /* Time packing faces into messages and unpacking them, part of comms */
+  double packing;
+
+  /* Bytes of y and z faces sent */
+  double bytes;
+
 } timings;
 
+/* Signature shared by all the sweepers */
+typedef timings (*sweeper)(mpistate mpi, options opt);
+
+/* Sweepers, selected with --sweep, indexing the registry below */
+enum sweep {SERIAL, PARGROUP, PARMPI, MULTILOCK, ONESIDED, MULTICORNER, TASKGRAPH, PREPOST, PARTITIONED, PSCW, SHARED, FUNNELED, BUNDLED, ANGLESETS, NSWEEPERS};
+
+/*
+ * A sweeper and what the driver needs to know about it.
+ * State which can be kept between sweeps, such as buffers, requests and
+ * windows, is built by init before the timed sweeps and freed by end.
+ * A sweeper still builds it on its first sweep if init was not called,
+ * and rebuilds it when the options it depends on change, as they do
+ * with --autotune.
+ */
+typedef struct sweeper_desc {
+  /* Name given to --sweep */
+  const char *name;
+
+  /* Printed as "Running <title>" */
+  const char *title;
+
+  /* Print the running line with the sweeper's settings instead - may be NULL */
+  void (*describe)(options opt);
+
+  /* Build the state kept between sweeps - may be NULL */
+  void (*init)(mpistate mpi, options opt);
+
+  /* Run one sweep */
+  sweeper run;
+
+  /* Free the state kept between sweeps - collective, and may be NULL */
+  void (*end)(void);
+
+  /* Whether groups are shared between threads */
+  int threaded;
+
+  /* Messages each face is sent in per chunk, for the performance model */
+  int (*msgs)(options opt);
+
+  /* Whether the sweeper can reuse persistent requests with --persistent */
+  int persistent;
+
+  /* Whether the sweeper supports reduced --precision, and reports the bytes it sends */
+  int wire;
+
+  /* Whether the sweeper supports faces in a flux array with --pack */
+  int flux_array;
+
+  /* Whether concurrent group sweeps are matched as selected with --match */
+  int group_match;
+
+} sweeper_desc;
+
+/* All the sweepers, indexed by enum sweep */
+extern const sweeper_desc sweepers[NSWEEPERS];
+
+/* Sweeper called name, or NULL if there is none */
+const sweeper_desc *find_sweeper(const char *name);
+
+/* Order in which the octants are swept */
+enum octants {ORDERED_OCTANTS, PIPELINED_OCTANTS};
+
+/*
+ * Octant numbers in sweep order, indexed by the octants option.
+ * Octant oct steps in direction oct&1 in x, (oct>>1)&1 in y and
+ * (oct>>2)&1 in z, where 0 is backwards and 1 forwards.
+ *
+ * The ordered sweep nests the loops in z, y then x.
+ * The pipelined sweep keeps the two octants which start from each YZ
+ * corner together, and then starts each pair from the corner where the
+ * previous pair finished where possible. The ranks which finish an
+ * octant last can then begin the next one straight away, rather than
+ * waiting for the pipeline to drain and refill from another corner.
+ */
+static const int octant_order[2][8] = {
+  {0, 1, 2, 3, 4, 5, 6, 7},
+  {0, 1, 6, 7, 2, 3, 4, 5}
+};
+
+/* Rule for choosing the next front in the multi-corner sweeper */
+enum priority {DEPTH_PRIORITY, EARLY_PRIORITY};
+
 /*
  * Vanilla serial KBA sweeper
  * For each octant, groups are computed serially in turn.
@@ -47,11 +135,19 @@ typedef struct timings {
  */
 timings serial_sweep(mpistate mpi, options opt);
 
+/* Build, or free, the buffers kept between sweeps, and the persistent requests with --persistent */
+void init_serial_context(mpistate mpi, options opt);
+void end_serial_context(void);
+
 /*
  * Parallel over groups, sending all groups in comms
  */
 timings par_group_sweep(mpistate mpi, options opt);
 
+/* Build, or free, the face buffers and messages kept between sweeps */
+void init_par_group_context(mpistate mpi, options opt);
+void end_par_group_context(void);
+
 /*
  * Parallel over groups, using OpenMP threads to run
  * individual group sweeps concurrently.
@@ -60,9 +156,115 @@ timings par_group_sweep(mpistate mpi, options opt);
  */
 timings par_mpi_sweep(mpistate mpi, options opt);
 
-/* Same as above, but uses multiple locks - one per thread */
+/* Build, or free, the buffers kept between sweeps, and the persistent requests with --persistent */
+void init_par_mpi_context(mpistate mpi, options opt);
+void end_par_mpi_context(void);
+
+/*
+ * Same as above, but scheduled with work stealing between per-thread
+ * queues of groups, each with its own lock
+ */
 timings par_mpi_multi_lock_sweep(mpistate mpi, options opt);
 
+/* Build, or free, the buffers, queues and group states kept between sweeps */
+void init_par_mpi_multi_lock_context(mpistate mpi, options opt);
+void end_par_mpi_multi_lock_context(void);
+
+/*
+ * Same as above, but thread 0 makes every MPI call, and passes the
+ * groups to and from the compute threads through lock-free rings
+ */
+timings funneled_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the buffers, rings and group states kept between sweeps */
+void init_funneled_context(mpistate mpi, options opt);
+void end_funneled_context(void);
+
 /* One sided sweeper, with parallel groups */
 timings one_sided_sweep(mpistate mpi, options opt);
 
+/*
+ * Same as above, but with active target post/start/complete/wait
+ * epochs between neighbours in place of the passive epoch
+ */
+timings pscw_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the windows kept between sweeps - collective over all ranks */
+void init_one_sided_context(mpistate mpi, options opt);
+void init_pscw_context(mpistate mpi, options opt);
+void end_one_sided_sweep(void);
+
+/*
+ * Sweeps from all four YZ corners run together, with parallel groups.
+ * Each rank interleaves the chunks of the fronts, running the ready
+ * chunk with the highest priority next.
+ */
+timings multi_corner_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the buffers kept between sweeps */
+void init_multi_corner_context(mpistate mpi, options opt);
+void end_multi_corner_context(void);
+
+/*
+ * Each chunk of each group is an OpenMP task, with dependences on its
+ * message buffers and detached tasks for the communication.
+ */
+timings task_graph_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the buffers and dependence tokens kept between sweeps */
+void init_task_graph_context(mpistate mpi, options opt);
+void end_task_graph_context(void);
+
+/*
+ * Parallel over groups, sending all groups in comms, with the receives
+ * for the next chunks posted ahead into a ring of buffers.
+ */
+timings prepost_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the buffers, rings and requests kept between sweeps */
+void init_prepost_context(mpistate mpi, options opt);
+void end_prepost_context(void);
+
+/*
+ * Parallel over groups inside bundles of --groups-per-msg groups, with
+ * each bundle's faces sent in one message as soon as it is swept.
+ */
+timings bundled_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the buffers and requests kept between sweeps */
+void init_bundled_context(mpistate mpi, options opt);
+void end_bundled_context(void);
+
+/*
+ * Parallel over groups, with the angles of each octant split into
+ * --angle-sets sets, and each set's faces sent in their own message as
+ * soon as it is swept.
+ */
+timings angle_set_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the buffers and requests kept between sweeps */
+void init_angle_set_context(mpistate mpi, options opt);
+void end_angle_set_context(void);
+
+/*
+ * Parallel over groups, with each face sent as one MPI 4 partitioned
+ * message holding a partition per group. Threads mark their groups'
+ * partitions ready as they finish them.
+ */
+timings partitioned_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the buffers and partitioned requests kept between sweeps */
+void init_partitioned_context(mpistate mpi, options opt);
+void end_partitioned_context(void);
+
+/*
+ * Parallel over groups, sending all groups in comms. Faces are passed
+ * in place through shared memory windows between ranks on the same
+ * node, and sent with MPI between nodes.
+ */
+timings shared_sweep(mpistate mpi, options opt);
+
+/* Build, or free, the shared windows and flags kept between sweeps - collective */
+void init_shared_context(mpistate mpi, options opt);
+void end_shared_context(void);
+
@@ -0,0 +1,371 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "compute.h"
+#include <mpi.h>
+#include <omp.h>
+#include "options.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "sweep.h"
+
+/* Message buffers per group, used in turn by consecutive chunks */
+#define NSLOTS 2
+
+/*
+ * Faces passed between one chunk of one group and its neighbours.
+ * x is NULL except on the chunk which passes the x face.
+ */
+typedef struct faces {
+  double *y, *z, *x;
+  int ycount, zcount, xcount;
+  int yrank, zrank, xrank;
+  int tag, xtag;
+  MPI_Comm comm;
+} faces;
+
+void init_task_graph_sweep(const int ycount, const int zcount, const int xcount, const int nbuf, double **ybuf, double **zbuf, double **xbuf);
+void end_task_graph_sweep(const int nbuf, double **ybuf, double **zbuf, double **xbuf);
+void post_faces(faces f, int send, omp_event_handle_t event);
+void post_pending(MPI_Request *req, omp_event_handle_t event);
+void progress_pending(void);
+
+/*
+ * Outstanding communication, one entry per detached task.
+ * Each entry holds the y, z and x requests, and the event fulfilled once
+ * they have all completed.
+ * Only accessed inside the taskgraph_mpi critical region, which also
+ * serialises all MPI calls.
+ */
+static struct {
+  MPI_Request req[3];
+  omp_event_handle_t event;
+} *pending;
+static int npending;
+
+/* Detached tasks not yet completed, including those yet to post their requests */
+static long nremaining;
+
+/* Time spent in MPI calls */
+static double commtime;
+
+/*
+ * Message buffers, dependence tokens and the table of outstanding
+ * communication, kept between sweeps until the face sizes or the number
+ * of groups change
+ */
+typedef struct task_graph_context {
+  int ycount, zcount, xcount, ng;
+  double **ybuf;
+  double **zbuf;
+  double **xbuf;
+  char *slot;
+  char *group;
+  char *xslot;
+  void *pending;
+} task_graph_context;
+
+static task_graph_context *context = NULL;
+
+/*
+ * Perform a KBA sweep as a graph of OpenMP tasks.
+ * Every (octant, chunk, group) has a receive, compute and send task.
+ * The receive and send tasks are detached: they post non-blocking
+ * operations and complete once a progress task sees them finish.
+ * Tasks using the same message buffer are ordered by a dependence on
+ * that buffer, and the compute tasks of a group by a dependence on the
+ * group, as they all update its flux. The tasks which pass the x face
+ * also depend on the group's x face buffer.
+ */
+timings task_graph_sweep(mpistate mpi, options opt) {
+
+  timings time = {
+    .sweeping = 0.0,
+    .setup = 0.0,
+    .comms = 0.0
+  };
+
+  /* Check MPI threading model is high enough */
+  if (mpi.thread_support < MPI_THREAD_SERIALIZED) {
+    if (mpi.rank == 0) {
+      printf("MPI library must support MPI_THREAD_SERIALIZED\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+
+  /* Every message is tagged with its octant, chunk and group */
+  int *tagub;
+  int flag;
+  MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tagub, &flag);
+  if (!flag || 8L*opt.nchunks*opt.ng - 1 > *tagub) {
+    if (mpi.rank == 0) {
+      printf("Too many chunks and groups to tag each message uniquely\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+
+  /* Message buffers and dependence tokens, built before the first sweep */
+  init_task_graph_context(mpi, opt);
+  const int ycount = context->ycount;
+  const int zcount = context->zcount;
+  const int xcount = context->xcount;
+  double **ybuf = context->ybuf;
+  double **zbuf = context->zbuf;
+  double **xbuf = context->xbuf;
+  char *slot = context->slot;
+  char *group = context->group;
+  char *xslot = context->xslot;
+
+  /* The tokens are only named in depend clauses, which do not count as a use */
+  (void)slot;
+  (void)group;
+  (void)xslot;
+
+  time.setup = MPI_Wtime();
+  pending = context->pending;
+  npending = 0;
+  nremaining = 2L*8*opt.nchunks*opt.ng;
+  commtime = 0.0;
+  time.setup = MPI_Wtime() - time.setup;
+
+  /* Start the timer */
+  double tick = MPI_Wtime();
+
+#pragma omp parallel
+#pragma omp single
+{
+  #pragma omp task
+  progress_pending();
+
+  for (int o = 0; o < 8; o++) {
+
+    const int oct = octant_order[opt.octants][o];
+
+    /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+    const int i = oct & 1;
+    const int j = (oct >> 1) & 1;
+    const int k = (oct >> 2) & 1;
+
+    const int xup = (i == 0) ? mpi.xhi : mpi.xlo;
+    const int xdown = (i == 0) ? mpi.xlo : mpi.xhi;
+    const int yup = (j == 0) ? mpi.yhi : mpi.ylo;
+    const int ydown = (j == 0) ? mpi.ylo : mpi.yhi;
+    const int zup = (k == 0) ? mpi.zhi : mpi.zlo;
+    const int zdown = (k == 0) ? mpi.zlo : mpi.zhi;
+
+    for (int c = 0; c < opt.nchunks; c++) {
+
+      for (int g = 0; g < opt.ng; g++) {
+
+        const int b = g*NSLOTS + (o*opt.nchunks + c) % NSLOTS;
+        omp_event_handle_t recvd, sent;
+
+        faces in = {
+          .y = ybuf[b], .z = zbuf[b], .x = (c == 0) ? xbuf[g] : NULL,
+          .ycount = ycount, .zcount = zcount, .xcount = xcount,
+          .yrank = yup, .zrank = zup, .xrank = xup,
+          .tag = (oct*opt.nchunks + c)*opt.ng + g, .xtag = oct*opt.ng + g,
+          .comm = mpi.comm
+        };
+        faces out = in;
+        out.x = (c == opt.nchunks-1) ? xbuf[g] : NULL;
+        out.yrank = ydown;
+        out.zrank = zdown;
+        out.xrank = xdown;
+
+        /* Receive payload from upwind neighbours, with the x face on the first chunk */
+        if (c == 0) {
+          #pragma omp task detach(recvd) depend(inout: slot[b], xslot[g])
+          post_faces(in, 0, recvd);
+        }
+        else {
+          #pragma omp task detach(recvd) depend(inout: slot[b])
+          post_faces(in, 0, recvd);
+        }
+
+        /* Do proportional "work" */
+        if (c == 0) {
+          #pragma omp task depend(inout: slot[b], group[g], xslot[g])
+          compute_chunk(opt, oct, c, g, 0, 1, ybuf[b], zbuf[b], xbuf[g]);
+        }
+        else {
+          #pragma omp task depend(inout: slot[b], group[g])
+          compute_chunk(opt, oct, c, g, 0, 1, ybuf[b], zbuf[b], xbuf[g]);
+        }
+
+        /* Send payload to downwind neighbours, with the x face after the last chunk */
+        if (c == opt.nchunks-1) {
+          #pragma omp task detach(sent) depend(inout: slot[b], xslot[g])
+          post_faces(out, 1, sent);
+        }
+        else {
+          #pragma omp task detach(sent) depend(inout: slot[b])
+          post_faces(out, 1, sent);
+        }
+
+      } /* End group loop */
+    } /* End nchunks loop */
+  } /* End octant loop */
+
+} /* End parallel region - all tasks have completed */
+
+  /* End the timer */
+  double tock = MPI_Wtime();
+
+  time.sweeping = tock-tick;
+  time.comms = commtime;
+
+  return time;
+}
+
+/* Post the receives or sends for a detached task */
+void post_faces(faces f, int send, omp_event_handle_t event) {
+  MPI_Request req[3] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+  #pragma omp critical (taskgraph_mpi)
+  {
+    double comtime = MPI_Wtime();
+    if (send) {
+      MPI_Isend(f.y, f.ycount, MPI_DOUBLE, f.yrank, f.tag, f.comm, req+0);
+      MPI_Isend(f.z, f.zcount, MPI_DOUBLE, f.zrank, f.tag, f.comm, req+1);
+      if (f.x) MPI_Isend(f.x, f.xcount, MPI_DOUBLE, f.xrank, f.xtag, f.comm, req+2);
+    }
+    else {
+      MPI_Irecv(f.y, f.ycount, MPI_DOUBLE, f.yrank, f.tag, f.comm, req+0);
+      MPI_Irecv(f.z, f.zcount, MPI_DOUBLE, f.zrank, f.tag, f.comm, req+1);
+      if (f.x) MPI_Irecv(f.x, f.xcount, MPI_DOUBLE, f.xrank, f.xtag, f.comm, req+2);
+    }
+    post_pending(req, event);
+    commtime += MPI_Wtime() - comtime;
+  }
+}
+
+/* Record the requests of a detached task. Called inside the taskgraph_mpi critical region */
+void post_pending(MPI_Request *req, omp_event_handle_t event) {
+  for (int r = 0; r < 3; r++) {
+    pending[npending].req[r] = req[r];
+  }
+  pending[npending].event = event;
+  npending++;
+}
+
+/*
+ * Test the outstanding communication, completing the detached task of
+ * any which has finished, and then go round again as a new task so
+ * that the thread can pick up other work in between.
+ */
+void progress_pending(void) {
+  int more;
+  #pragma omp critical (taskgraph_mpi)
+  {
+    double comtime = MPI_Wtime();
+    for (int p = 0; p < npending; ) {
+      int done;
+      MPI_Testall(3, pending[p].req, &done, MPI_STATUSES_IGNORE);
+      if (done) {
+        omp_fulfill_event(pending[p].event);
+        pending[p] = pending[--npending];
+        nremaining--;
+      }
+      else {
+        p++;
+      }
+    }
+    more = nremaining > 0;
+    commtime += MPI_Wtime() - comtime;
+  }
+
+  if (more) {
+    #pragma omp task
+    progress_pending();
+  }
+}
+
+/* Allocate MPI message buffers */
+void init_task_graph_sweep(const int ycount, const int zcount, const int xcount, const int nbuf, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < nbuf; b++) {
+    ybuf[b] = malloc(sizeof(double)*ycount);
+    zbuf[b] = malloc(sizeof(double)*zcount);
+  }
+  for (int b = 0; b < nbuf/NSLOTS; b++) {
+    xbuf[b] = malloc(sizeof(double)*xcount);
+  }
+}
+
+/* Free MPI message buffers */
+void end_task_graph_sweep(const int nbuf, double **ybuf, double **zbuf, double **xbuf) {
+  for (int b = 0; b < nbuf; b++) {
+    free(ybuf[b]);
+    free(zbuf[b]);
+  }
+  for (int b = 0; b < nbuf/NSLOTS; b++) {
+    free(xbuf[b]);
+  }
+}
+
+
+/*
+ * Build the message buffers - NSLOTS per group, each holding a single
+ * group's faces, and one x face per group - the dependence tokens for
+ * each buffer, each group and each group's x face, and room for an
+ * outstanding operation on every buffer, unless those from an earlier
+ * sweep are still right.
+ */
+void init_task_graph_context(mpistate mpi, options opt) {
+  (void)mpi;
+  const int ycount = opt.nang * opt.nz * opt.chunklen;
+  const int zcount = opt.nang * opt.ny * opt.chunklen;
+  const int xcount = opt.nang * opt.ny * opt.nz;
+  if (context) {
+    if (context->ycount == ycount && context->zcount == zcount && context->xcount == xcount && context->ng == opt.ng) return;
+    end_task_graph_context();
+  }
+
+  context = malloc(sizeof(task_graph_context));
+  context->ycount = ycount;
+  context->zcount = zcount;
+  context->xcount = xcount;
+  context->ng = opt.ng;
+
+  const int nbuf = opt.ng * NSLOTS;
+  context->ybuf = malloc(sizeof(double *)*nbuf);
+  context->zbuf = malloc(sizeof(double *)*nbuf);
+  context->xbuf = malloc(sizeof(double *)*opt.ng);
+  init_task_graph_sweep(ycount, zcount, xcount, nbuf, context->ybuf, context->zbuf, context->xbuf);
+
+  context->slot = malloc(nbuf);
+  context->group = malloc(opt.ng);
+  context->xslot = malloc(opt.ng);
+  context->pending = malloc(sizeof(*pending)*nbuf);
+}
+
+/* Free the message buffers, dependence tokens and outstanding communication table */
+void end_task_graph_context(void) {
+  if (!context) return;
+
+  end_task_graph_sweep(context->ng * NSLOTS, context->ybuf, context->zbuf, context->xbuf);
+  free(context->ybuf);
+  free(context->zbuf);
+  free(context->xbuf);
+  free(context->slot);
+  free(context->group);
+  free(context->xslot);
+  free(context->pending);
+  free(context);
+  context = NULL;
+}
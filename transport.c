@@ -0,0 +1,318 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include <math.h>
+#include <mpi.h>
+#include "options.h"
+#include "pack.h"
+#include <stdlib.h>
+#include <string.h>
+#include "transport.h"
+
+/*
+ * Problem data owned by this rank.
+ * Per-group arrays are stored [g][cell] in the angle layout and
+ * [cell][g] in the group layout, with angles always innermost.
+ */
+static double *psi;    /* Angular flux for the current octant */
+static double *phi;    /* Scalar flux */
+static double *source; /* Fixed source */
+static double *sigt;   /* Total cross section */
+static double *xface;  /* Face carried between chunks in x [oct][g][z][y][a] */
+
+/* Twice the direction cosines, their sum and the quadrature weights, one per angle */
+static double *cmu;
+static double *ceta;
+static double *cxi;
+static double *csum;
+static double *weight;
+
+/* Whether the upwind face is a vacuum boundary, indexed by octant direction */
+static int xvacuum[2];
+static int yvacuum[2];
+static int zvacuum[2];
+
+/* Index of the value for group g in a cell */
+static inline long gidx(options opt, long ncells, int g, long cell) {
+  return (opt.layout == ANGLE_LAYOUT) ? g*ncells + cell : cell*opt.ng + g;
+}
+
+/*
+ * Sweep the cells of one chunk for one group, for the na angles from a0.
+ * The x face and angular flux hold every angle, and gxface starts at a0.
+ * Inlined into its callers so that na can be a compile time constant.
+ */
+static inline void sweep_cells(const options *opt, const int na, int a0, int i, int j, int k, int cx, int g, int fstride, double *yface, double *zface, double *gxface) {
+
+  const int nang = opt->nang;
+  const int yrow = opt->chunklen * face_planes(*opt, Y_FACE);
+  const int nx = opt->nchunks * opt->chunklen;
+  const long ncells = (long)nx * opt->ny * opt->nz;
+  const int ny = opt->ny;
+  const int nz = opt->nz;
+  const int chunklen = opt->chunklen;
+
+  for (int zz = 0; zz < nz; zz++) {
+    const int z = (k == 0) ? nz-1-zz : zz;
+
+    for (int yy = 0; yy < ny; yy++) {
+      const int y = (j == 0) ? ny-1-yy : yy;
+
+      for (int xx = 0; xx < chunklen; xx++) {
+        const int x = (i == 0) ? chunklen-1-xx : xx;
+
+        const long cell = cx*chunklen + x + (long)nx*(y + (long)ny*z);
+        const long n = gidx(*opt, ncells, g, cell);
+        const double q = source[n];
+        const double st = sigt[n];
+
+        double * restrict px = gxface + nang*(y + ny*z);
+        double * restrict py = yface + (long)fstride*(x + yrow*z);
+        double * restrict pz = zface + (long)fstride*(x + chunklen*y);
+        double * restrict p = psi + n*nang + a0;
+        const double * restrict amu = cmu + a0;
+        const double * restrict aeta = ceta + a0;
+        const double * restrict axi = cxi + a0;
+        const double * restrict asum = csum + a0;
+        const double * restrict aweight = weight + a0;
+
+        /*
+         * Diamond difference, vectorised over the angles.
+         * Any angles left over from the vector width are handled
+         * by the remainder of the simd loop.
+         */
+        double flux = 0.0;
+        #pragma omp simd reduction(+:flux)
+        for (int a = 0; a < na; a++) {
+          const double v = (q + amu[a]*px[a] + aeta[a]*py[a] + axi[a]*pz[a]) / (st + asum[a]);
+          px[a] = 2.0*v - px[a];
+          py[a] = 2.0*v - py[a];
+          pz[a] = 2.0*v - pz[a];
+          p[a] = v;
+          flux += aweight[a]*v;
+        }
+        phi[n] += flux;
+      }
+    }
+  }
+}
+
+/*
+ * Copies of the cell sweep with the number of angles fixed at build time,
+ * so the angle loop needs no remainder and can be fully unrolled.
+ */
+#define SWEEP_CELLS_N(N) \
+  void sweep_cells_##N(const options *opt, int na, int a0, int i, int j, int k, int cx, int g, int fstride, double *yface, double *zface, double *gxface) { \
+    (void)na; \
+    sweep_cells(opt, N, a0, i, j, k, cx, g, fstride, yface, zface, gxface); \
+  }
+
+SWEEP_CELLS_N(8)
+SWEEP_CELLS_N(16)
+SWEEP_CELLS_N(32)
+SWEEP_CELLS_N(48)
+SWEEP_CELLS_N(64)
+
+/* Generic cell sweep for any number of angles */
+void sweep_cells_any(const options *opt, int na, int a0, int i, int j, int k, int cx, int g, int fstride, double *yface, double *zface, double *gxface) {
+  sweep_cells(opt, na, a0, i, j, k, cx, g, fstride, yface, zface, gxface);
+}
+
+typedef void (*sweep_cells_fn)(const options *, int, int, int, int, int, int, int, int, double *, double *, double *);
+
+/* Dispatch table of the specialised angle counts */
+static const struct {
+  int nang;
+  sweep_cells_fn fn;
+} sweep_table[] = {
+  {8, sweep_cells_8},
+  {16, sweep_cells_16},
+  {32, sweep_cells_32},
+  {48, sweep_cells_48},
+  {64, sweep_cells_64}
+};
+
+/* Cell sweep selected for all the angles */
+static sweep_cells_fn sweep_fn;
+
+/* Specialised cell sweep for na angles if there is one, otherwise the generic one */
+static sweep_cells_fn select_sweep(int na) {
+  sweep_cells_fn fn = sweep_cells_any;
+  for (size_t n = 0; n < sizeof(sweep_table)/sizeof(sweep_table[0]); n++) {
+    if (sweep_table[n].nang == na) {
+      fn = sweep_table[n].fn;
+    }
+  }
+  return fn;
+}
+
+void init_transport(mpistate mpi, options opt) {
+
+  const long ncells = (long)opt.nchunks * opt.chunklen * opt.ny * opt.nz;
+
+  psi = malloc(sizeof(double)*ncells*opt.nang*opt.ng);
+  phi = malloc(sizeof(double)*ncells*opt.ng);
+  source = malloc(sizeof(double)*ncells*opt.ng);
+  sigt = malloc(sizeof(double)*ncells*opt.ng);
+  xface = malloc(sizeof(double)*opt.nang*opt.ny*opt.nz*opt.ng*8);
+
+  cmu = malloc(sizeof(double)*opt.nang);
+  ceta = malloc(sizeof(double)*opt.nang);
+  cxi = malloc(sizeof(double)*opt.nang);
+  csum = malloc(sizeof(double)*opt.nang);
+  weight = malloc(sizeof(double)*opt.nang);
+
+  /* Unit source everywhere, with the cross section increasing with group */
+  for (int g = 0; g < opt.ng; g++) {
+    for (long cell = 0; cell < ncells; cell++) {
+      source[gidx(opt, ncells, g, cell)] = 1.0;
+      sigt[gidx(opt, ncells, g, cell)] = 1.0 + 0.1*g;
+    }
+  }
+
+  /*
+   * Spread the angles over the octant. The quadrature is not intended
+   * to be accurate, just to give each angle a different path.
+   * The cells have unit width, so the diamond difference coefficients
+   * are twice the direction cosines.
+   */
+  for (int a = 0; a < opt.nang; a++) {
+    double mu = (a + 0.5) / opt.nang;
+    double t = (opt.nang - a - 0.5) / opt.nang;
+    cmu[a] = 2.0 * mu;
+    ceta[a] = 2.0 * sqrt((1.0 - mu*mu) * t);
+    cxi[a] = 2.0 * sqrt((1.0 - mu*mu) * (1.0 - t));
+    csum[a] = cmu[a] + ceta[a] + cxi[a];
+    weight[a] = 1.0 / (8.0 * opt.nang);
+  }
+
+  /* Octant direction 0 receives from the hi neighbour, 1 from the lo neighbour */
+  xvacuum[0] = (mpi.xhi == MPI_PROC_NULL);
+  xvacuum[1] = (mpi.xlo == MPI_PROC_NULL);
+  yvacuum[0] = (mpi.yhi == MPI_PROC_NULL);
+  yvacuum[1] = (mpi.ylo == MPI_PROC_NULL);
+  zvacuum[0] = (mpi.zhi == MPI_PROC_NULL);
+  zvacuum[1] = (mpi.zlo == MPI_PROC_NULL);
+
+  /* Pick a specialised cell sweep if there is one for this many angles */
+  sweep_fn = select_sweep(opt.nang);
+
+  reset_transport(opt);
+}
+
+void end_transport(void) {
+  free(psi);
+  free(phi);
+  free(source);
+  free(sigt);
+  free(xface);
+  free(cmu);
+  free(ceta);
+  free(cxi);
+  free(csum);
+  free(weight);
+}
+
+void reset_transport(options opt) {
+  const long ncells = (long)opt.nchunks * opt.chunklen * opt.ny * opt.nz;
+  memset(phi, 0, sizeof(double)*ncells*opt.ng);
+}
+
+void transport_chunk(options opt, int oct, int c, int g, int gb, int ngb, int a0, int na, double *ybuf, double *zbuf, double *xbuf) {
+
+  /* Octant directions - 0 is stepping backwards, 1 is stepping forwards */
+  const int i = oct & 1;
+  const int j = (oct >> 1) & 1;
+  const int k = (oct >> 2) & 1;
+
+  const int nang = opt.nang;
+  const int ny = opt.ny;
+  const int nz = opt.nz;
+  const int chunklen = opt.chunklen;
+
+  /* Chunks are visited in the direction of travel in x */
+  const int cx = (i == 0) ? opt.nchunks-1-c : c;
+
+  /*
+   * Find this group's faces in the message buffers, and the distance between face cells.
+   * Faces kept in a flux array are spread over its planes, so rows of the y face, and
+   * the groups of either face in the angle layout, are further apart.
+   */
+  const int fstride = (opt.layout == ANGLE_LAYOUT) ? na : ngb*na;
+  const int yplanes = face_planes(opt, Y_FACE);
+  const int zplanes = face_planes(opt, Z_FACE);
+  double *yface = (opt.layout == ANGLE_LAYOUT) ? ybuf + (long)gb*na*nz*chunklen*yplanes : ybuf + gb*na;
+  double *zface = (opt.layout == ANGLE_LAYOUT) ? zbuf + (long)gb*na*ny*chunklen*zplanes : zbuf + gb*na;
+  /* Each octant carries its own x face, so chunks of different octants may be interleaved */
+  double *gxface = xface + ((long)oct*opt.ng + g)*nang*ny*nz + a0;
+  double *xmsg = NULL;
+  if (xbuf) {
+    xmsg = (opt.layout == ANGLE_LAYOUT) ? xbuf + (long)gb*na*ny*nz : xbuf + gb*na;
+  }
+
+  /*
+   * Vacuum boundaries - nothing was received so the incoming flux is zero.
+   * Otherwise the first chunk starts from the x face sent by the upwind rank.
+   */
+  if (c == 0) {
+    for (int f = 0; f < ny*nz; f++) {
+      if (xvacuum[i] || !xmsg) {
+        memset(gxface + (long)f*nang, 0, sizeof(double)*na);
+      }
+      else {
+        memcpy(gxface + (long)f*nang, xmsg + (long)f*fstride, sizeof(double)*na);
+      }
+    }
+  }
+  if (yvacuum[j]) {
+    for (int z = 0; z < nz; z++) {
+      for (int x = 0; x < chunklen; x++) {
+        memset(yface + (long)fstride*(x + chunklen*yplanes*z), 0, sizeof(double)*na);
+      }
+    }
+  }
+  if (zvacuum[k]) {
+    for (int f = 0; f < ny*chunklen; f++) {
+      memset(zface + (long)f*fstride, 0, sizeof(double)*na);
+    }
+  }
+
+  sweep_cells_fn fn = (na == nang) ? sweep_fn : select_sweep(na);
+  fn(&opt, na, a0, i, j, k, cx, g, fstride, yface, zface, gxface);
+
+  /* Pass the x face on to the downwind rank after the last chunk */
+  if (c == opt.nchunks-1 && xmsg) {
+    for (int f = 0; f < ny*nz; f++) {
+      memcpy(xmsg + (long)f*fstride, gxface + (long)f*nang, sizeof(double)*na);
+    }
+  }
+}
+
+int transport_specialised(void) {
+  return sweep_fn != sweep_cells_any;
+}
+
+double transport_checksum(options opt) {
+  const long ncells = (long)opt.nchunks * opt.chunklen * opt.ny * opt.nz;
+  double sum = 0.0;
+  for (long n = 0; n < ncells*opt.ng; n++) {
+    sum += phi[n];
+  }
+  return sum;
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Data carrying transport kernel
+ * Each rank owns angular flux, scalar flux, source and cross section
+ * arrays for its subdomain. A diamond difference update is performed
+ * for every cell and angle, consuming the incoming y and z faces from
+ * the message buffers and leaving the outgoing faces in their place.
+ */
+
+#pragma once
+
+#include "comms.h"
+#include "options.h"
+
+/* Allocate and initialise the per-rank problem data */
+void init_transport(mpistate mpi, options opt);
+
+/* Free the problem data */
+void end_transport(void);
+
+/* Zero the scalar flux ready for a new sweep */
+void reset_transport(options opt);
+
+/* Storage order of the angular flux and of multi-group face buffers */
+enum layout {ANGLE_LAYOUT, GROUP_LAYOUT};
+
+/*
+ * Sweep one chunk of cells for group g in the given octant, for the na
+ * angles starting at a0.
+ * The buffers hold the faces of ngb groups, of which group g is number gb.
+ * They only hold the angles being swept, so nang below is na.
+ * For a single group the faces are laid out as:
+ *   yface[z][x][a] of size nang*nz*chunklen
+ *   zface[y][x][a] of size nang*ny*chunklen
+ *   xface[z][y][a] of size nang*ny*nz
+ * With several groups the angle layout stores each group's face in
+ * turn, [gb][face][a], while the group layout interleaves them as
+ * [face][gb][a].
+ * With --pack datatype or manual the y and z faces are planes of flux
+ * arrays instead, as described in pack.h.
+ * Incoming values are read and replaced with the outgoing values.
+ * The x face is carried between the chunks of an octant, so xbuf is
+ * only used with a 3D decomposition: the incoming face is read from it
+ * on the first chunk, and the outgoing face written to it on the last.
+ * It may be NULL otherwise.
+ */
+void transport_chunk(options opt, int oct, int c, int g, int gb, int ngb, int a0, int na, double *ybuf, double *zbuf, double *xbuf);
+
+/* Whether a cell sweep specialised for this number of angles was selected */
+int transport_specialised(void);
+
+/* Sum of the scalar flux on this rank */
+double transport_checksum(options opt);
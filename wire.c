@@ -0,0 +1,144 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "comms.h"
+#include "model.h"
+#include <mpi.h>
+#include "options.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sweep.h"
+#include "wire.h"
+
+int wire_bytes(options opt) {
+  if (opt.precision == FP32_WIRE) return sizeof(float);
+  if (opt.precision == BF16_WIRE) return sizeof(uint16_t);
+  return sizeof(double);
+}
+
+MPI_Datatype wire_type(options opt) {
+  if (opt.precision == FP32_WIRE) return MPI_FLOAT;
+  if (opt.precision == BF16_WIRE) return MPI_UINT16_T;
+  return MPI_DOUBLE;
+}
+
+void *init_wire(options opt, double *face, long count) {
+  if (opt.precision == FP64_WIRE) return face;
+  return malloc(wire_bytes(opt)*count);
+}
+
+void end_wire(options opt, void *wire) {
+  if (opt.precision != FP64_WIRE) free(wire);
+}
+
+void *wire_at(options opt, void *wire, long n) {
+  return (char *)wire + n*wire_bytes(opt);
+}
+
+/*
+ * bfloat16 is the top half of a float, so it is rounded there by adding
+ * just under half of the dropped bits, plus one more if that would make
+ * an odd result even. Faces are always finite.
+ */
+void pack_wire(options opt, const double *face, void *wire, long count) {
+  if (opt.precision == FP32_WIRE) {
+    float * restrict w = wire;
+    #pragma omp simd
+    for (long n = 0; n < count; n++) {
+      w[n] = (float)face[n];
+    }
+  }
+  else if (opt.precision == BF16_WIRE) {
+    uint16_t * restrict w = wire;
+    #pragma omp simd
+    for (long n = 0; n < count; n++) {
+      const float f = (float)face[n];
+      uint32_t u;
+      memcpy(&u, &f, sizeof(u));
+      u += 0x7fff + ((u >> 16) & 1);
+      w[n] = (uint16_t)(u >> 16);
+    }
+  }
+}
+
+void unpack_wire(options opt, const void *wire, double *face, long count) {
+  if (opt.precision == FP32_WIRE) {
+    const float * restrict w = wire;
+    #pragma omp simd
+    for (long n = 0; n < count; n++) {
+      face[n] = w[n];
+    }
+  }
+  else if (opt.precision == BF16_WIRE) {
+    const uint16_t * restrict w = wire;
+    #pragma omp simd
+    for (long n = 0; n < count; n++) {
+      const uint32_t u = (uint32_t)w[n] << 16;
+      float f;
+      memcpy(&f, &u, sizeof(f));
+      face[n] = f;
+    }
+  }
+}
+
+void print_wire(mpistate mpi, options opt, perfmodel model, timings *times) {
+
+  /*
+   * A sweep takes as long as its slowest rank, so every rank picks the
+   * same sweep: the one whose slowest rank was fastest
+   */
+  double *sweeping = malloc(opt.nsweeps*sizeof(double));
+  for (int s = 0; s < opt.nsweeps; s++) {
+    sweeping[s] = times[s].sweeping;
+  }
+  MPI_Allreduce(MPI_IN_PLACE, sweeping, opt.nsweeps, MPI_DOUBLE, MPI_MAX, mpi.comm);
+  int min = 0;
+  for (int s = 1; s < opt.nsweeps; s++) {
+    if (sweeping[s] < sweeping[min]) min = s;
+  }
+
+  /*
+   * Every rank's bytes cross the network, but the sweep only waits for
+   * the slowest rank, so the saving and conversion cost are that rank's
+   */
+  const double saved = times[min].bytes * (sizeof(double) - wire_bytes(opt)) / wire_bytes(opt) * model.gap;
+  double local[2] = {saved, times[min].packing};
+  double slowest[2];
+  double bytes;
+  MPI_Reduce(&times[min].bytes, &bytes, 1, MPI_DOUBLE, MPI_SUM, 0, mpi.comm);
+  MPI_Reduce(local, slowest, 2, MPI_DOUBLE, MPI_MAX, 0, mpi.comm);
+
+  if (mpi.rank != 0) {
+    free(sweeping);
+    return;
+  }
+
+  printf("Face payloads\n");
+  printf("  Sweep:           %11.6lf s slowest rank\n", sweeping[min]);
+  printf("  Bytes sent:      %11.3lf MB\n", bytes*1.0e-6);
+  printf("  At full width:   %11.3lf MB\n", bytes*sizeof(double)/wire_bytes(opt)*1.0e-6);
+  printf("  Packing:         %11.6lf s\n", slowest[1]);
+  printf("  Transfer saved:  %11.6lf s predicted\n", slowest[0]);
+  printf("  Net saving:      %11.6lf s predicted\n", slowest[0] - slowest[1]);
+  printf("====================\n");
+  printf("\n");
+
+  free(sweeping);
+}
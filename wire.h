@@ -0,0 +1,63 @@
+/*
+ * This file is part of road-sweeper.
+ *
+ * road-sweeper is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * road-sweeper is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with road-sweeper.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Face payloads on the wire
+ * The y and z faces can be narrowed to single precision or bfloat16 before
+ * they are sent, and widened again when they arrive, trading conversion
+ * work for fewer bytes on the network. The sweep itself stays in double.
+ */
+
+#pragma once
+
+#include "comms.h"
+#include <mpi.h>
+#include "model.h"
+#include "options.h"
+#include "sweep.h"
+
+/* Precision of a face value on the wire */
+enum precision {FP64_WIRE, FP32_WIRE, BF16_WIRE};
+
+/* Bytes, and MPI datatype, of one face value on the wire */
+int wire_bytes(options opt);
+MPI_Datatype wire_type(options opt);
+
+/*
+ * Wire buffer for a face buffer of count values. At full precision this is
+ * the face buffer itself, and packing and unpacking do nothing.
+ */
+void *init_wire(options opt, double *face, long count);
+void end_wire(options opt, void *wire);
+
+/* Address of value n in a wire buffer */
+void *wire_at(options opt, void *wire, long n);
+
+/* Narrow count face values into a wire buffer, rounding to nearest even */
+void pack_wire(options opt, const double *face, void *wire, long count);
+
+/* Widen count values of a wire buffer back into the face buffer */
+void unpack_wire(options opt, const void *wire, double *face, long count);
+
+/*
+ * Print the face bytes sent by all ranks in the sweep whose slowest rank
+ * was fastest, the time spent converting them, and the transfer time the
+ * model predicts was saved over sending them at full precision.
+ * Collective over all ranks.
+ */
+void print_wire(mpistate mpi, options opt, perfmodel model, timings *times);